@@ -33,7 +33,6 @@
 #include <hotarubi/memory.h>
 #include <hotarubi/log/log.h>
 
-#include <new>
 #include <iterators.h>
 
 namespace acpi
@@ -44,6 +43,9 @@ namespace acpi
 static struct rsdt *rsdt = nullptr;
 static struct xsdt *xsdt = nullptr;
 
+/* NUMA node of each local APIC as reported by the SRAT */
+static uint8_t _apic_node[256];
+
 static system_descriptor_table*
 _get_table( const char *signature )
 {
@@ -109,8 +111,133 @@ calc_iter<madt_entry> end( struct madt& madt )
 	  ( void * )( ( ( uintptr_t )&madt ) + madt.length ) );
 };
 
+/* iteration support on srat tables */
+static auto srat_add = []( uintptr_t& ptr ) {
+	ptr += ( ( srat_entry* )ptr )->length;
+};
+
+static auto srat_get = []( uintptr_t ptr ) {
+	return ( srat_entry* )ptr;
+};
+
+calc_iter<srat_entry> begin( struct srat& srat )
+{
+	return calc_iter<srat_entry>( srat_add, srat_get, &srat.entries[0] );
+};
+
+calc_iter<srat_entry> end( struct srat& srat )
+{
+	return calc_iter<srat_entry>(
+	  srat_add, srat_get,
+	  ( void * )( ( ( uintptr_t )&srat ) + srat.length ) );
+};
+
 /* ---- */
 
+/* map sparse proximity domains to node ids 0..n */
+static uint8_t
+_domain_node( uint32_t domain, uint32_t domains[], unsigned &node_count )
+{
+	for( unsigned i = 0; i < node_count; ++i )
+	{
+		if( domains[i] == domain )
+		{
+			return i;
+		}
+	}
+	if( node_count < PHYSMM_MAX_NODES )
+	{
+		domains[node_count] = domain;
+		return node_count++;
+	}
+	return 0;
+}
+
+static void
+_parse_numa( void )
+{
+	memory::physmm::node_range ranges[PHYSMM_MAX_RANGES];
+	uint8_t  distance[PHYSMM_MAX_NODES * PHYSMM_MAX_NODES];
+	uint32_t domains[PHYSMM_MAX_NODES];
+	unsigned range_count = 0;
+	unsigned node_count  = 0;
+
+	auto srat = ( struct srat* )_get_table( ACPI_SRAT_SIG );
+	if( srat == nullptr )
+	{
+		log::printk( "acpi: no SRAT, assuming a single NUMA node\n" );
+		return;
+	}
+
+	for( auto entry : *srat )
+	{
+		switch( entry->type )
+		{
+			case SRATEntryType::kLAPICAffinity:
+			{
+				auto desc = ( srat_lapic_affinity* )entry;
+				if( flag_set( desc->flags, SRATAffinityFlags::kEnabled ) )
+				{
+					_apic_node[desc->apic_id] = _domain_node( desc->domain(), domains, node_count );
+				}
+				break;
+			}
+
+			case SRATEntryType::kx2APICAffinity:
+			{
+				auto desc = ( srat_x2apic_affinity* )entry;
+				if( flag_set( desc->flags, SRATAffinityFlags::kEnabled ) &&
+				    desc->x2apic_id < sizeof( _apic_node ) )
+				{
+					_apic_node[desc->x2apic_id] = _domain_node( desc->domain, domains, node_count );
+				}
+				break;
+			}
+
+			case SRATEntryType::kMemoryAffinity:
+			{
+				auto desc = ( srat_memory_affinity* )entry;
+				if( flag_set( desc->flags, SRATAffinityFlags::kEnabled ) &&
+				    desc->length > 0 && range_count < PHYSMM_MAX_RANGES )
+				{
+					auto range    = &ranges[range_count++];
+					range->base   = desc->base;
+					range->length = desc->length;
+					range->node   = _domain_node( desc->domain, domains, node_count );
+
+					log::printk( "acpi: memory %#016lx - %#016lx on node %d\n",
+					             range->base, range->base + range->length, range->node );
+				}
+				break;
+			}
+
+			default:
+				break;
+		}
+	}
+
+	auto slit = ( struct slit* )_get_table( ACPI_SLIT_SIG );
+	if( slit != nullptr )
+	{
+		for( unsigned from = 0; from < node_count; ++from )
+		{
+			for( unsigned to = 0; to < node_count; ++to )
+			{
+				uint8_t dist = ( from == to ) ? 10 : 20;
+				if( domains[from] < slit->localities && domains[to] < slit->localities )
+				{
+					dist = slit->entries[domains[from] * slit->localities + domains[to]];
+				}
+				distance[from * node_count + to] = dist;
+			}
+		}
+	}
+
+	log::printk( "acpi: detected %d NUMA nodes\n", node_count );
+	memory::physmm::init_numa( ranges, range_count, ( slit != nullptr ) ? distance : nullptr,
+	                           node_count );
+}
+
 void
 parse_madt( processor::core *&aps, uint32_t &core_count,
             processor::ioapic *&ioapics, uint32_t &ioapic_count  )
@@ -181,7 +308,7 @@ parse_madt( processor::core *&aps, uint32_t &core_count,
 	if( core_count > 0 )
 	{
 		log::printk( "acpi: detected %i processors\n", core_count );
-		aps = new( std::nothrow ) processor::core[core_count - 1];
+		aps = new( memory::boot_arena() ) processor::core[core_count - 1];
 	}
 	else
 	{
@@ -190,7 +317,7 @@ parse_madt( processor::core *&aps, uint32_t &core_count,
 	if( ioapic_count > 0 )
 	{
 		log::printk( "acpi: detected %i IOAPICs\n", ioapic_count );
-		ioapics = new( std::nothrow ) processor::ioapic[ioapic_count];
+		ioapics = new( memory::boot_arena() ) processor::ioapic[ioapic_count];
 	}
 	else
 	{
@@ -206,11 +333,13 @@ parse_madt( processor::core *&aps, uint32_t &core_count,
 			case MADTEntryType::kLAPIC:
 			{
 				auto desc   = ( madt_lapic_entry* )entry;
-				auto lapic  = new( std::nothrow ) processor::lapic( desc->apic_id, lapic_base );
-				
-				processor::core::instance( desc->processor_id - core_base )->lapic = lapic;
-				log::printk( "acpi: detected LAPIC %d for processor %d\n",
-			                 desc->apic_id, desc->processor_id );
+				auto lapic  = new( memory::boot_arena() ) processor::lapic( desc->apic_id, lapic_base );
+				auto core   = processor::core::instance( desc->processor_id - core_base );
+
+				core->lapic = lapic;
+				core->node  = _apic_node[desc->apic_id];
+				log::printk( "acpi: detected LAPIC %d for processor %d on node %d\n",
+			                 desc->apic_id, desc->processor_id, core->node );
 				break;
 			}
 
@@ -346,6 +475,8 @@ init_tables( void )
 		}
 		rsd_ptr = nullptr;
 	}
+
+	_parse_numa();
 }
 
 };
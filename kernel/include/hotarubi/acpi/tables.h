@@ -33,6 +33,8 @@ namespace acpi
 	#define ACPI_RSDT_SIG "RSDT"
 	#define ACPI_XSDT_SIG "XSDT"
 	#define ACPI_MADT_SIG "APIC"
+	#define ACPI_SRAT_SIG "SRAT"
+	#define ACPI_SLIT_SIG "SLIT"
 
 	#pragma pack( push, 1 )
 
@@ -192,6 +194,77 @@ namespace acpi
 		uint32_t          flags;
 		struct madt_entry entries[1];
 	};
+
+	enum class SRATEntryType : uint8_t
+	{
+		kLAPICAffinity   = 0,
+		kMemoryAffinity  = 1,
+		kx2APICAffinity  = 2,
+	};
+
+	enum class SRATAffinityFlags : uint32_t
+	{
+		kEnabled      = ( 1 << 0 ),
+		kHotPluggable = ( 1 << 1 ),
+		kNonVolatile  = ( 1 << 2 ),
+
+		is_bitmask,
+	};
+
+	struct srat_entry
+	{
+		SRATEntryType type;
+		uint8_t       length;
+	};
+
+	struct srat_lapic_affinity : public srat_entry
+	{
+		uint8_t           domain_lo;
+		uint8_t           apic_id;
+		SRATAffinityFlags flags;
+		uint8_t           sapic_eid;
+		uint8_t           domain_hi[3];
+		uint32_t          clock_domain;
+
+		uint32_t domain( void ) const
+		{
+			return domain_lo | ( domain_hi[0] << 8 ) | ( domain_hi[1] << 16 ) | ( domain_hi[2] << 24 );
+		};
+	};
+
+	struct srat_memory_affinity : public srat_entry
+	{
+		uint32_t          domain;
+		uint16_t          _reserved0;
+		uint64_t          base;
+		uint64_t          length;
+		uint32_t          _reserved1;
+		SRATAffinityFlags flags;
+		uint64_t          _reserved2;
+	};
+
+	struct srat_x2apic_affinity : public srat_entry
+	{
+		uint16_t          _reserved0;
+		uint32_t          domain;
+		uint32_t          x2apic_id;
+		SRATAffinityFlags flags;
+		uint32_t          clock_domain;
+		uint32_t          _reserved1;
+	};
+
+	struct srat : public system_descriptor_table
+	{
+		uint32_t          _reserved0;
+		uint64_t          _reserved1;
+		struct srat_entry entries[1];
+	};
+
+	struct slit : public system_descriptor_table
+	{
+		uint64_t localities;
+		uint8_t  entries[1]; /* localities * localities distances */
+	};
 };
 
 #endif
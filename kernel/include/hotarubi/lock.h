@@ -40,6 +40,11 @@ public:
 		do {} while( _lock.test_and_set( std::memory_order_acquire ) );
 	}
 
+	bool try_lock( void )
+	{
+		return !_lock.test_and_set( std::memory_order_acquire );
+	}
+
 	void unlock( void )
 	{
 		_lock.clear( std::memory_order_release );
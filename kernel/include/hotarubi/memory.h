@@ -27,18 +27,30 @@
 #include <hotarubi/memory/cache.h>
 #include <hotarubi/memory/const.h>
 #include <hotarubi/memory/kmalloc.h>
+#include <hotarubi/memory/kmalloc_profile.h>
+#include <hotarubi/memory/vmalloc.h>
+#include <hotarubi/memory/arena.h>
 #include <hotarubi/memory/mmio.h>
+#include <hotarubi/processor/regs.h>
+#include <hotarubi/log/log.h>
 
 namespace memory
 {
 	inline void init( struct multiboot_info *multiboot_info )
 	{
+		uint64_t start = processor::regs::read_tsc();
+
 		/* make sure these are called in correct order */
 		physmm::init( multiboot_info );
 		virtmm::init();
 		cache::init();
 		kmalloc::init();
+		vmalloc::init();
+		kmalloc_profile::init();
         mmio::init();
+
+		log::printk( "memory: init took %lu cycles\n",
+		             processor::regs::read_tsc() - start );
 	};
 
     inline void init_ap( void )
@@ -0,0 +1,98 @@
+/*******************************************************************************
+
+    Copyright (C) 2014  René 'Shirk' Köcher
+ 
+    This file is part of Hotarubi.
+
+    Hotarubi is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+ 
+    Hotarubi is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+ 
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*******************************************************************************/
+
+
+
+/* arena - bump allocation for boot and table parsing */
+
+#ifndef __MEMORY_ARENA_H
+#define __MEMORY_ARENA_H 1
+
+#include <new>
+
+#include <hotarubi/types.h>
+
+/* pages taken from physmm at once, larger requests get a chunk of their own */
+#define ARENA_CHUNK_PAGES 4
+#define ARENA_MIN_ALIGN   16
+
+namespace memory
+{
+	struct arena_chunk;
+
+	/* hands out memory from zeroed page chunks without a per object header
+	 * Objects can't be freed one by one, release() returns all chunks at
+	 * once and does not run destructors.
+	 * Not locked, an arena belongs to a single boot or parsing phase.
+	 */
+	class arena
+	{
+	public:
+		constexpr arena( unsigned chunk_pages = ARENA_CHUNK_PAGES )
+		: _chunks{ nullptr }, _pos{ 0 }, _end{ 0 }, _used{ 0 },
+		  _chunk_pages{ chunk_pages } {};
+
+		/* align has to be a power of two */
+		void *alloc( size_t n, size_t align = ARENA_MIN_ALIGN );
+		void release( void );
+
+		/* bytes handed out since the last release */
+		size_t used( void ) const
+		{
+			return _used;
+		};
+
+		template <typename T, typename... Args>
+		T *create( Args&&... args )
+		{
+			void *ptr = alloc( sizeof( T ), alignof( T ) );
+
+			return ( ptr != nullptr ) ? new( ptr ) T( static_cast<Args&&>( args )... )
+			                          : nullptr;
+		};
+
+	private:
+		struct arena_chunk *_chunks; /* the first one is bumped */
+		uintptr_t _pos;
+		uintptr_t _end;
+		size_t _used;
+		unsigned _chunk_pages;
+	};
+
+	/* objects that stay around for as long as the kernel runs */
+	arena &boot_arena( void );
+};
+
+/* new( arena ) T / new( arena ) T[n] - returns nullptr once physmm runs dry */
+inline void *operator new( size_t n, memory::arena &arena ) noexcept
+{
+	return arena.alloc( n );
+}
+
+inline void *operator new[]( size_t n, memory::arena &arena ) noexcept
+{
+	return arena.alloc( n );
+}
+
+inline void operator delete( void*, memory::arena& ) noexcept {}
+inline void operator delete[]( void*, memory::arena& ) noexcept {}
+
+#endif
@@ -31,6 +31,15 @@ namespace cache
 {
 	#define SLAB_SIZE PAGE_SIZE
 	#define SLAB_MAX_FRAGMENT_SIZE( x ) ( x ) / 8
+	#define SLAB_MAX_WASTE( x ) ( x ) / 8
+	#define SLAB_MAX_ORDER 3 /* slabs span up to SLAB_SIZE << SLAB_MAX_ORDER */
+
+	#define CACHE_MAX_COLOURS  16 /* slab colours per cache */
+	#define CACHE_CPU_SLOTS    32 /* caches with per-core magazines */
+	#define CACHE_MAGAZINE_CORES 64 /* cores using magazines, others take the slab path */
+	#define CACHE_MAGAZINE_MAX 32 /* upper limit for set_magazine_size() */
+	#define CACHE_MAX_SHRINKERS 8
+	#define CACHE_LOCKLESS_CORES 64 /* cores using Mode::kLockless fast paths */
 
 	typedef void  (*cache_obj_setup)( void *ptr, size_t obj_size );
 	typedef void  (*cache_obj_erase)( void *ptr );
@@ -40,6 +49,21 @@ namespace cache
 
 	typedef struct mem_cache *mem_cache_t;
 
+	/* per-core front end of a cache
+	 * kMagazine - per-core magazines of objects with a shared depot
+	 * kLockless - per-core active slabs handled with cmpxchg16b, only for
+	 *             caches that keep their bufctls inline ( small objects ),
+	 *             others fall back to kMagazine */
+	enum class Mode : uint8_t
+	{
+		kMagazine = 0,
+		kLockless = 1,
+	};
+
+	/* asked to give back pages when memory runs low, returns the number of
+	 * pages freed - called from allocation context, so it must not allocate */
+	typedef size_t (*shrink_callback)( size_t pages );
+
 	struct mem_cache_stats
 	{
 		size_t slabs;
@@ -50,18 +74,35 @@ namespace cache
 		size_t cache_misses;
 
 		size_t overflows;
+
+		size_t slab_size;  /* bytes per slab */
+		size_t slab_waste; /* bytes per slab not covered by buffers */
+
+		size_t colours;                         /* colours used by the cache */
+		size_t colour_slabs[CACHE_MAX_COLOURS]; /* slabs per colour */
 	};
 	typedef struct mem_cache_stats mem_cache_stats_t;
 
+	/* per-core magazines of a cache, lives in core_local_data */
+	struct cpu_cache
+	{
+		struct magazine *loaded;
+		struct magazine *previous;
+	};
+
 	mem_cache_t create( const char *name, size_t size, size_t align = 1,
 		                bool check_overflow = true,
 		                cache_obj_setup setup = nullptr,
 		                cache_obj_erase erase = nullptr,
 		                backend_alloc back_alloc = nullptr, 
-		                backend_free  back_free  = nullptr );
+		                backend_free  back_free  = nullptr,
+		                Mode mode = Mode::kMagazine );
 
 	bool reap( mem_cache_t cache );
 
+	/* magazines loaded by other cores are handed back on their next trip
+	 * through the magazine layer, a refused release leaves the magazines of
+	 * cache disabled so a later attempt can succeed */
 	bool release( mem_cache_t cache, bool force = false );
 
 	void stats( mem_cache_t cache, mem_cache_stats_t &statbuf );
@@ -70,9 +111,41 @@ namespace cache
 
 	void put_object( mem_cache_t cache, void *ptr );
 
+	/* get_object / put_object for caches whose layout is known at compile
+	 * time ( see object_cache<> ), Compact and Markers have to match it */
+	template <bool Compact, bool Markers> void *get_object( mem_cache_t cache );
+
+	template <bool Compact, bool Markers> void put_object( mem_cache_t cache, void *ptr );
+
+	/* take the cache lock once for count objects, get_objects returns the
+	 * number of objects stored to objects[] */
+	unsigned get_objects( mem_cache_t cache, unsigned count, void *objects[] );
+
+	void put_objects( mem_cache_t cache, unsigned count, void *const objects[] );
+
 	mem_cache_t get_cache( void *ptr );
 
+	/* a small value of the owner's choice kept with the pages of cache,
+	 * get_tag finds it from any object without a lookup in the owner -
+	 * set it before the first allocation, 0 is returned for foreign pointers */
+	void set_tag( mem_cache_t cache, uint8_t tag );
+
+	uint8_t get_tag( void *ptr );
+
+	/* release free slabs of all caches and run the shrinkers until pages
+	 * pages have been freed, returns the number of pages actually freed */
+	size_t reclaim( size_t pages );
+
+	bool register_shrinker( shrink_callback shrink );
+
+	void unregister_shrinker( shrink_callback shrink );
+
+	/* objects per magazine, 0 disables the magazine layer of cache */
+	bool set_magazine_size( mem_cache_t cache, unsigned size );
+
 	void init( void );
+
+	void init_cpu_cache( void );
 };
 };
 
@@ -25,6 +25,7 @@
 #define _MEMORY_KMALLOC_H 1
 
 #include <cstddef>
+#include <cstdint>
 
 namespace memory
 {
@@ -38,4 +39,20 @@ void *kmalloc( size_t n );
 void *krealloc( void *ptr, size_t n );
 void kfree( void *ptr );
 
+/* align up to PAGE_SIZE, kmalloc itself aligns to 16 bytes */
+void *kmalloc_aligned( size_t n, size_t align );
+
+/* kmalloc / kmalloc_aligned charging the profiler to site instead of their
+ * caller, for wrappers like operator new */
+void *kmalloc_at( size_t n, uintptr_t site );
+void *kmalloc_aligned_at( size_t n, size_t align, uintptr_t site );
+
+/* free without looking up the class, n and align have to match the
+ * kmalloc / kmalloc_aligned call that returned ptr */
+void kfree_sized( void *ptr, size_t n, size_t align = 0 );
+
+/* allocate count objects of n bytes, returns the number stored to ptrs[] */
+unsigned kmalloc_bulk( size_t n, unsigned count, void *ptrs[] );
+void kfree_bulk( unsigned count, void *const ptrs[] );
+
 #endif
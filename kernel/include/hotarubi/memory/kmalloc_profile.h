@@ -0,0 +1,99 @@
+/*******************************************************************************
+
+    Copyright (C) 2014  René 'Shirk' Köcher
+ 
+    This file is part of Hotarubi.
+
+    Hotarubi is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+ 
+    Hotarubi is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+ 
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*******************************************************************************/
+
+
+
+/* kmalloc allocation-site profiler
+ *
+ * Built with -DKMALLOC_PROFILE ( KMALLOC_PROFILE=1 rake ) kmalloc and kfree
+ * account live bytes and counts to the return address of their caller.
+ * Wrappers like operator new pass their own caller in through kmalloc_at().
+ * Without it the hooks expand to nothing.
+ */
+
+#ifndef __MEMORY_KMALLOC_PROFILE_H
+#define __MEMORY_KMALLOC_PROFILE_H 1
+
+#include <hotarubi/types.h>
+
+#ifdef KMALLOC_PROFILE
+
+namespace memory
+{
+namespace kmalloc_profile
+{
+	struct site_stats
+	{
+		uintptr_t site;
+		uint64_t allocs;
+		uint64_t frees;
+		int64_t live; /* bytes */
+	};
+
+	void init( void );
+
+	/* per core tables from here on, allocations before count to core 0 */
+	void init_cpu( void );
+
+	void record_alloc( const void *ptr, size_t n, uintptr_t site );
+	void record_free( const void *ptr );
+
+	/* store the top sites by live bytes to stats[], returns their number */
+	unsigned collect( unsigned top, struct site_stats stats[] );
+
+	/* print the top sites, "rake profile:kmalloc" resolves the addresses */
+	void dump( unsigned top );
+};
+};
+
+#define KMALLOC_PROFILE_SITE() \
+	( ( uintptr_t )__builtin_return_address( 0 ) )
+
+#define KMALLOC_PROFILE_ALLOC_AT( ptr, n, site ) \
+	memory::kmalloc_profile::record_alloc( ( ptr ), ( n ), ( site ) )
+
+#define KMALLOC_PROFILE_ALLOC( ptr, n ) \
+	KMALLOC_PROFILE_ALLOC_AT( ( ptr ), ( n ), KMALLOC_PROFILE_SITE() )
+
+#define KMALLOC_PROFILE_FREE( ptr ) \
+	memory::kmalloc_profile::record_free( ( ptr ) )
+
+#else
+
+namespace memory
+{
+namespace kmalloc_profile
+{
+	inline void init( void ) {};
+	inline void init_cpu( void ) {};
+	inline void dump( unsigned ) {};
+};
+};
+
+#define KMALLOC_PROFILE_SITE() ( ( uintptr_t )0 )
+
+#define KMALLOC_PROFILE_ALLOC_AT( ptr, n, site ) do { ( void )( site ); } while( 0 )
+#define KMALLOC_PROFILE_ALLOC( ptr, n ) do {} while( 0 )
+#define KMALLOC_PROFILE_FREE( ptr ) do {} while( 0 )
+
+#endif
+
+#endif
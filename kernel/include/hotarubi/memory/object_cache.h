@@ -0,0 +1,119 @@
+/*******************************************************************************
+
+    Copyright (C) 2014  René 'Shirk' Köcher
+ 
+    This file is part of Hotarubi.
+
+    Hotarubi is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+ 
+    Hotarubi is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+ 
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*******************************************************************************/
+
+
+/* typed object caches */
+
+#ifndef __MEMORY_OBJECT_CACHE_H
+#define __MEMORY_OBJECT_CACHE_H 1
+
+#include <new>
+
+#include <hotarubi/types.h>
+#include <hotarubi/memory/cache.h>
+
+namespace memory
+{
+	/* compile time options of an object_cache<> */
+	struct cache_policy
+	{
+		static constexpr bool check_overflow = true;
+		static constexpr cache::Mode mode    = cache::Mode::kMagazine;
+	};
+
+	/* no overflow markers, for hot objects that are known to behave */
+	struct cache_policy_unchecked : cache_policy
+	{
+		static constexpr bool check_overflow = false;
+	};
+
+	/* cache of T, constructed and destroyed in place
+	 * The object path is picked at compile time: objects below
+	 * SLAB_MAX_FRAGMENT_SIZE of the smallest slab always keep their bufctl
+	 * inline, which together with the marker policy selects the specialised
+	 * get_object / put_object. The slab size and colouring are still chosen
+	 * by cache::create. Larger objects may or may not end up compact
+	 * depending on the slab order and take the generic ones.
+	 */
+	template <typename T, typename Policy = cache_policy>
+	class object_cache
+	{
+	public:
+		static constexpr bool compact = sizeof( T ) < SLAB_MAX_FRAGMENT_SIZE( SLAB_SIZE );
+		static constexpr bool markers = Policy::check_overflow;
+
+		constexpr object_cache() : _cache{ nullptr } {};
+
+		bool init( const char *name )
+		{
+			_cache = cache::create( name, sizeof( T ), alignof( T ), markers,
+			                        nullptr, nullptr, nullptr, nullptr, Policy::mode );
+			return _cache != nullptr;
+		};
+
+		bool release( bool force = false )
+		{
+			return cache::release( _cache, force );
+		};
+
+		template <typename... Args>
+		T *create( Args&&... args )
+		{
+			void *ptr = ( compact ) ? cache::get_object<compact, markers>( _cache )
+			                        : cache::get_object( _cache );
+
+			return ( ptr != nullptr ) ? new( ptr ) T( static_cast<Args&&>( args )... )
+			                          : nullptr;
+		};
+
+		void destroy( T *object )
+		{
+			if( object != nullptr )
+			{
+				object->~T();
+				if( compact )
+				{
+					cache::put_object<compact, markers>( _cache, object );
+				}
+				else
+				{
+					cache::put_object( _cache, object );
+				}
+			}
+		};
+
+		cache::mem_cache_t get( void ) const
+		{
+			return _cache;
+		};
+
+	private:
+		cache::mem_cache_t _cache;
+	};
+
+	template <typename T, typename Policy>
+	constexpr bool object_cache<T, Policy>::compact;
+
+	template <typename T, typename Policy>
+	constexpr bool object_cache<T, Policy>::markers;
+};
+
+#endif
@@ -41,6 +41,28 @@
 /* shortcut to access PhysPageFlagSet */
 #define __PPF( x ) memory::physmm::Flags::k ##x
 
+/* largest block order handled by the buddy allocator ( 2^10 pages = 4MB ) */
+#define PHYSMM_MAX_ORDER 10
+
+/* NUMA limits, nodes and memory ranges beyond these are merged into others */
+#define PHYSMM_MAX_NODES  8
+#define PHYSMM_MAX_RANGES 32
+
+/* per-CPU page cache sizing ( in pages, PHYSMM_PCP_SIZE must be a power of 2 )
+ * the cache is refilled by PHYSMM_PCP_BATCH pages once it drops to the low
+ * watermark and drained by PHYSMM_PCP_BATCH pages once it exceeds the high one
+ */
+#define PHYSMM_PCP_SIZE  64
+#define PHYSMM_PCP_BATCH 16
+#define PHYSMM_PCP_LOW   0
+#define PHYSMM_PCP_HIGH  48
+
+/* number of pre-zeroed pages kept for kZeroed requests */
+#define PHYSMM_ZERO_POOL_SIZE 256
+
+/* free pages below which the reclaim callback is run */
+#define PHYSMM_RECLAIM_WATERMARK 1024
+
 namespace memory
 {
 namespace physmm
@@ -52,6 +74,14 @@ namespace physmm
 		kLocked       = ( 1 << 2 ),
 		kReserved     = ( 1 << 3 ),
 		kSlab         = ( 1 << 4 ),
+		kBuddy        = ( 1 << 5 ), /* head of a free buddy block */
+		kCached       = ( 1 << 6 ), /* held by a per-CPU page cache */
+
+		/* allocation requests only - select the highest zone to use */
+		kZoneDMA      = ( 1 << 8 ),  /* below 16MB */
+		kZoneDMA32    = ( 1 << 9 ),  /* below 4GB */
+		kZoneNormal   = ( 1 << 10 ), /* anywhere ( default ) */
+		kZeroed       = ( 1 << 11 ), /* clear the page contents */
 
 		is_bitmask
 	};
@@ -60,15 +90,94 @@ namespace physmm
 	{
 		struct list_head link;
 		Flags flags;
+		uint8_t order; /* block order while flagged kBuddy */
+		uint8_t slab_tag; /* cache::set_tag() of the owner while flagged kSlab */
+		uint16_t section; /* 128MB section the entry belongs to */
 	};
 	typedef struct page_map page_map_t;
 
+	/* ring of cached page addresses, the most recently freed ( hot ) page
+	 * lives at head, the least recently used ( cold ) one count - 1 below it
+	 */
+	struct page_cache
+	{
+		uint16_t head;
+		uint16_t count;
+		phys_addr_t pages[PHYSMM_PCP_SIZE];
+	};
+
+	/* physical memory attached to a NUMA node */
+	struct node_range
+	{
+		phys_addr_t base;
+		uint64_t length;
+		uint8_t node;
+	};
+
+	/* pre-zeroed page pool counters */
+	struct zero_pool_stats
+	{
+		uint64_t hits;   /* kZeroed pages taken from the pool */
+		uint64_t misses; /* kZeroed pages cleared on allocation */
+		uint64_t zeroed; /* pages cleared by zero_idle_pages() */
+		uint32_t pooled;
+	};
+
+	/* per zone telemetry, ranges larger than PHYSMM_MAX_ORDER are counted
+	 * as PHYSMM_MAX_ORDER, fragmentation is the share of free memory that
+	 * can not serve a request of the given order in 1/1000
+	 */
+	struct zone_stats
+	{
+		const char *name;
+		uint8_t node;
+		phys_addr_t start;
+		phys_addr_t end;
+
+		uint64_t free_pages;
+		uint64_t largest_free_run; /* in pages */
+		uint16_t fragmentation[PHYSMM_MAX_ORDER + 1];
+
+		uint64_t alloc_count[PHYSMM_MAX_ORDER + 1];
+		uint64_t free_count[PHYSMM_MAX_ORDER + 1];
+		uint64_t alloc_failed;
+
+		uint64_t lock_count;
+		uint64_t lock_wait_cycles;
+		uint64_t lock_hold_cycles;
+	};
+
 	void init( const multiboot_info_t *boot_info );
+	/* distance is a node_count * node_count matrix ( ACPI SLIT ) or nullptr */
+	void init_numa( const struct node_range ranges[], unsigned range_count,
+	                const uint8_t distance[], unsigned node_count );
 
 	void set_physical_base_offset( const phys_addr_t offset );
 	phys_addr_t physical_base_offset( void );
 
+	/* initialize the page metadata not yet touched since boot, optional */
+	void init_deferred( void );
+
+	/* fill the pre-zeroed page pool, meant to run on an otherwise idle core */
+	void zero_idle_pages( void );
+	void get_zero_pool_stats( struct zero_pool_stats *stats );
+
+	/* has to be called on each core once %gs points to its local data */
+	void init_page_cache( void );
+	void drain_page_cache( void );
+
 	uint32_t free_page_count( void );
+	uint32_t free_page_count( Flags zone );
+
+	unsigned zone_count( void );
+	bool get_zone_stats( unsigned zone, struct zone_stats *stats );
+	/* print the statistics of all zones using log::printk */
+	void dump_stats( void );
+
+	/* asked to free up pages once memory runs low, returns the number of
+	 * pages freed - may run from any allocation, including its own */
+	typedef size_t (*reclaim_callback)( size_t pages );
+	void set_reclaim_callback( reclaim_callback reclaim );
 
 	void *alloc_page( Flags flags );
 	void *alloc_page_range( unsigned count, Flags flags );
@@ -76,6 +185,11 @@ namespace physmm
 	void free_page( const void *page );
 	void free_page_range( const void *page, unsigned count );
 
+	/* count single, not necessarily contiguous pages taking each zone lock
+	 * only once, alloc_pages_bulk returns the number of pages stored */
+	unsigned alloc_pages_bulk( unsigned count, Flags flags, void *pages[] );
+	void free_pages_bulk( void *const pages[], unsigned count );
+
 	page_map_t *get_page_map( phys_addr_t paddr );
 };
 };
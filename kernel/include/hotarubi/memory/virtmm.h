@@ -64,7 +64,12 @@ namespace virtmm
 
 	void unmap_address( virt_addr_t vaddr );
 	void unmap_fixed( virt_addr_t vaddr );
-	void unmap_address_range( virt_addr_t vaddr, size_t npages );
+	/* flush = false leaves stale TLB entries behind, the caller has to
+	 * flush_tlb() before the range is mapped again */
+	void unmap_address_range( virt_addr_t vaddr, size_t npages, bool flush = true );
+
+	/* drop all non-global TLB entries of the local core */
+	void flush_tlb( void );
 
 	bool lookup_mapping( virt_addr_t vaddr, uint64_t &pml4e, uint64_t &pdpte,
 	                                     uint64_t &pdte, uint64_t &pte );
@@ -0,0 +1,49 @@
+/*******************************************************************************
+
+    Copyright (C) 2014  René 'Shirk' Köcher
+ 
+    This file is part of Hotarubi.
+
+    Hotarubi is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+ 
+    Hotarubi is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+ 
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*******************************************************************************/
+
+
+/* vmalloc / vfree - virtually contiguous allocations */
+
+#ifndef _MEMORY_VMALLOC_H
+#define _MEMORY_VMALLOC_H 1
+
+#include <cstddef>
+
+namespace memory
+{
+namespace vmalloc
+{
+	/* true if ptr lies within the vmalloc range */
+	bool owns( const void *ptr );
+
+	/* usable size of the allocation at ptr, 0 if there is none */
+	size_t size( const void *ptr );
+
+	void init( void );
+};
+};
+
+/* individually allocated pages mapped at a contiguous address,
+ * freed ranges are only reused after a batched TLB flush */
+void *vmalloc( size_t n );
+void vfree( void *ptr );
+
+#endif
@@ -105,6 +105,14 @@ namespace regs
 
 		__asm__ __volatile__( "wrmsr" :: "c"( reg ), "d"( hi ), "a"( lo ) );
 	};
+
+	inline uint64_t read_tsc( void )
+	{
+		uint32_t lo, hi;
+		__asm__ __volatile__( "rdtsc" : "=d"( hi ), "=a"( lo ) );
+
+		return ( ( uint64_t ) hi << 32 ) | lo;
+	};
 };
 };
 
@@ -284,7 +284,7 @@ struct hlist_node
 /* iterate over each link in the list with support for the deletion of links */
 #define HLIST_FOREACH_MUTABLE( ptr, head ) \
 	for( struct hlist_node *ptr = ( head )->next, \
-		                   *ref = ptr->next; \
+		                   *ref = nullptr; \
 		 ptr != nullptr && ( { ref = ptr->next; 1; } ); \
 		 ptr  = ref )
 
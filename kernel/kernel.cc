@@ -48,6 +48,9 @@ kernel_entry( uint32_t loader_magic, struct multiboot_info *multiboot_info )
 	memory::init( multiboot_info );
 
 	processor::init();
+
+	/* no-op unless built with KMALLOC_PROFILE=1 */
+	memory::kmalloc_profile::dump( 16 );
 	__UNDER_CONSTRUCTION__;
 }
 
@@ -59,5 +62,10 @@ kernel_ap_entry( void )
 
 	processor::init();
 
+	/* finish the page metadata skipped during boot */
+	memory::physmm::init_deferred();
+	/* nothing else to do here yet, prepare zeroed pages instead */
+	memory::physmm::zero_idle_pages();
+
 	__UNDER_CONSTRUCTION__;
 }
@@ -25,34 +25,51 @@
 
 #include <hotarubi/types.h>
 #include <hotarubi/memory/kmalloc.h>
+#include <hotarubi/memory/kmalloc_profile.h>
 
+#ifdef KERNEL
+/* the hosted <new> of the tests brings these along */
 namespace std
 {
 	const nothrow_t nothrow{};
 }
 
 void*
-operator new( size_t size, const std::nothrow_t& ) noexcept
+operator new( size_t, void *ptr ) noexcept
 {
-	return kmalloc( size );
+	return ptr;
 }
 
 void*
-operator new( size_t, void *ptr ) noexcept
+operator new[]( size_t, void *ptr ) noexcept
 {
 	return ptr;
 }
 
+void
+operator delete( void*, void* ) noexcept
+{
+	/* placement delete.. */
+}
+
+void
+operator delete[]( void*, void* ) noexcept
+{
+	/* placement delete */
+}
+#endif
+
 void*
-operator new[]( size_t size, const std::nothrow_t& ) noexcept
+operator new( size_t size, const std::nothrow_t& ) noexcept
 {
-	return kmalloc( size );
+	/* charge the profiler to the caller of new, not to new itself */
+	return kmalloc_at( size, KMALLOC_PROFILE_SITE() );
 }
 
 void*
-operator new[]( size_t, void *ptr ) noexcept
+operator new[]( size_t size, const std::nothrow_t& ) noexcept
 {
-	return ptr;
+	return kmalloc_at( size, KMALLOC_PROFILE_SITE() );
 }
 
 void
@@ -62,19 +79,76 @@ operator delete( void *ptr ) noexcept
 }
 
 void
-operator delete( void*, void* ) noexcept
+operator delete[]( void *ptr ) noexcept
 {
-	/* placement delete.. */
+	kfree( ptr );
 }
 
+/* C++14 sized deallocation, the size picks the kmalloc class without a
+ * page map lookup - called explicitly, see <new> */
 void
-operator delete[]( void *ptr ) noexcept
+operator delete( void *ptr, size_t size ) noexcept
 {
-	kfree( ptr );
+	if( ptr != nullptr )
+	{
+		kfree_sized( ptr, size );
+	}
 }
 
 void
-operator delete[]( void*, void* ) noexcept
+operator delete[]( void *ptr, size_t size ) noexcept
 {
-	/* placement delete */
+	if( ptr != nullptr )
+	{
+		kfree_sized( ptr, size );
+	}
+}
+
+/* C++17 over-aligned types, called explicitly as well */
+void*
+operator new( size_t size, std::align_val_t align, const std::nothrow_t& ) noexcept
+{
+	return kmalloc_aligned_at( size, static_cast<size_t>( align ), KMALLOC_PROFILE_SITE() );
+}
+
+void*
+operator new[]( size_t size, std::align_val_t align, const std::nothrow_t& ) noexcept
+{
+	return kmalloc_aligned_at( size, static_cast<size_t>( align ), KMALLOC_PROFILE_SITE() );
+}
+
+void
+operator delete( void *ptr, std::align_val_t ) noexcept
+{
+	if( ptr != nullptr )
+	{
+		kfree( ptr );
+	}
+}
+
+void
+operator delete[]( void *ptr, std::align_val_t ) noexcept
+{
+	if( ptr != nullptr )
+	{
+		kfree( ptr );
+	}
+}
+
+void
+operator delete( void *ptr, size_t size, std::align_val_t align ) noexcept
+{
+	if( ptr != nullptr )
+	{
+		kfree_sized( ptr, size, static_cast<size_t>( align ) );
+	}
+}
+
+void
+operator delete[]( void *ptr, size_t size, std::align_val_t align ) noexcept
+{
+	if( ptr != nullptr )
+	{
+		kfree_sized( ptr, size, static_cast<size_t>( align ) );
+	}
 }
@@ -0,0 +1,141 @@
+/*******************************************************************************
+
+    Copyright (C) 2014  René 'Shirk' Köcher
+ 
+    This file is part of Hotarubi.
+
+    Hotarubi is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+ 
+    Hotarubi is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+ 
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*******************************************************************************/
+
+
+
+/* arena - bump allocation for boot and table parsing
+ *
+ * Each chunk starts with an arena_chunk header linking it to the others,
+ * the rest of it is handed out front to back. Requests which don't fit a
+ * chunk of ARENA_CHUNK_PAGES get a chunk sized to fit, linked behind the
+ * current one so the space left there is still used.
+ */
+
+#include <hotarubi/memory/arena.h>
+#include <hotarubi/memory/page.h>
+
+#ifdef KERNEL
+#include <hotarubi/memory/physmm.h>
+#endif
+
+namespace memory
+{
+
+struct arena_chunk
+{
+	struct arena_chunk *next;
+	size_t pages;
+};
+
+#ifdef KERNEL
+
+static void*
+_arena_page_alloc( size_t pages )
+{
+	return physmm::alloc_page_range( pages, __PPF( Locked ) | __PPF( Zeroed ) );
+}
+
+static void
+_arena_page_free( void *ptr, size_t pages )
+{
+	physmm::free_page_range( ptr, pages );
+}
+
+#else
+
+extern void* _arena_page_alloc( size_t pages );
+extern void  _arena_page_free( void *ptr, size_t pages );
+
+#endif
+
+static arena _boot_arena;
+
+static inline uintptr_t
+_arena_align( uintptr_t pos, size_t align )
+{
+	return ( pos + align - 1 ) & ~( uintptr_t )( align - 1 );
+}
+
+void*
+arena::alloc( size_t n, size_t align )
+{
+	if( align < ARENA_MIN_ALIGN )
+	{
+		align = ARENA_MIN_ALIGN;
+	}
+
+	uintptr_t pos = _arena_align( _pos, align );
+	if( _chunks == nullptr || pos + n > _end )
+	{
+		size_t pages   = ( sizeof( struct arena_chunk ) + align - 1 + n + PAGE_SIZE - 1 ) / PAGE_SIZE;
+		bool oversized = ( pages > _chunk_pages );
+
+		pages = ( oversized ) ? pages : _chunk_pages;
+
+		auto chunk = ( struct arena_chunk* )_arena_page_alloc( pages );
+		if( chunk == nullptr )
+		{
+			return nullptr;
+		}
+		chunk->pages = pages;
+		pos          = _arena_align( ( uintptr_t )( chunk + 1 ), align );
+
+		if( oversized && _chunks != nullptr )
+		{
+			/* nothing else fits, keep bumping the current chunk */
+			chunk->next    = _chunks->next;
+			_chunks->next  = chunk;
+			_used         += n;
+			return ( void* )pos;
+		}
+
+		chunk->next = _chunks;
+		_chunks     = chunk;
+		_end        = ( uintptr_t )chunk + pages * PAGE_SIZE;
+	}
+
+	_pos   = pos + n;
+	_used += n;
+	return ( void* )pos;
+}
+
+void
+arena::release( void )
+{
+	while( _chunks != nullptr )
+	{
+		auto chunk = _chunks;
+
+		_chunks = chunk->next;
+		_arena_page_free( chunk, chunk->pages );
+	}
+	_pos  = 0;
+	_end  = 0;
+	_used = 0;
+}
+
+arena&
+boot_arena( void )
+{
+	return _boot_arena;
+}
+
+};
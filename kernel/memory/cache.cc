@@ -21,18 +21,15 @@
 
 /* SLAB based cache allocator */
 
-/* TODO: replace the obj_map with a faster hash based version
- * TODO: add coloring to the SLAB buffers
- * TODO: maybe support per-core caches to get around any locking at all
- */
-
 #include <hotarubi/lock.h>
+#include <hotarubi/macros.h>
 #include <hotarubi/log/log.h>
 
 #include <hotarubi/memory/cache.h>
+#include <hotarubi/memory/physmm.h>
 
 #ifdef KERNEL
-#include <hotarubi/memory/physmm.h>
+#include <hotarubi/processor/core.h>
 #endif
 
 #include <string.h>
@@ -41,8 +38,17 @@
 /* NOTE: since these caches need to be SMP safe all methods below
  *       starting with an underscore (_) expect mem_cache.lock to be held
  *       while beeing called and will by themself do no further locking.
+ *       The magazine layer ( _magazine_*, _depot_*, _cpu_cache_* ) is the
+ *       exception, it uses mem_cache.depot_lock and disabled interrupts.
  */
 
+/* initial obj_hash buckets, embedded into struct mem_cache */
+#define CACHE_HASH_INIT_SHIFT 3
+#define CACHE_HASH_INIT_SIZE  ( 1 << CACHE_HASH_INIT_SHIFT )
+
+LOCAL_DATA_INC( hotarubi/memory/cache.h );
+LOCAL_DATA_DEF( struct memory::cache::cpu_cache cpu_caches[CACHE_CPU_SLOTS] );
+
 namespace memory
 {
 namespace cache
@@ -53,32 +59,97 @@ struct mem_cache
 	const char *name;
 	bool compact;
 	bool markers;
+	uint8_t tag; /* see set_tag() */
 
 	size_t obj_size;
 	size_t obj_align;
 
 	size_t alloc_size;
 
+	/* slab colouring, the first buffer of each new slab is shifted by
+	 * colour_next * colour_step bytes to spread them over the cpu caches */
+	size_t colour_step;
+	unsigned colours;
+	unsigned colour_next;
+
 	cache_obj_setup obj_setup = nullptr;
 	cache_obj_erase obj_erase = nullptr;
 
 	backend_alloc slab_alloc = nullptr;
 	backend_free  slab_free  = nullptr;
 
+	/* magazine layer, cpu_slot indexes core_local_data::cpu_caches */
+	unsigned magazine_size;
+	int cpu_slot;
+
+	/* Mode::kLockless, CACHE_LOCKLESS_CORES entries indexed by core id */
+	struct lockless_cpu *lockless;
+
 	LIST_HEAD( free );
 	LIST_HEAD( used );
 	LIST_HEAD( full );
 
-	// FIXME: HASH_TABLE( obj_map );
-	LIST_HEAD( obj_map );
+	/* bufctls of non-compact caches hashed by buffer address,
+	 * obj_hash points to obj_hash_init until the first resize */
+	struct hlist_head *obj_hash;
+	unsigned obj_hash_shift;
+	size_t obj_hash_count;
+	HLIST_HEAD( obj_hash_init )[CACHE_HASH_INIT_SIZE];
 
 	mem_cache_stats_t stats;
 	spin_lock lock;
+
+	/* full and empty magazines not loaded by any core */
+	struct magazine *depot_full;
+	struct magazine *depot_empty;
+	spin_lock depot_lock;
+
+	LIST_LINK( caches ); /* _cache_list */
+};
+
+/* magazine layer ( Bonwick & Adams, "Magazines and Vmem" )
+ * Each core keeps a loaded and a previous magazine of objects per cache in
+ * its local data. get_object() and put_object() are served from these with
+ * interrupts disabled but without touching any shared cache line. Only when
+ * both are empty ( or full ) they are exchanged against a full ( or empty )
+ * one from the depot of the cache, the slab layer below is reached only if
+ * the depot can't help either.
+ */
+struct magazine
+{
+	struct magazine *next; /* depot link */
+	unsigned rounds;
+	void *objs[CACHE_MAGAZINE_MAX];
 };
 
+#define CACHE_LINE_SIZE 64
+
+/* lock-free per-core slabs ( Mode::kLockless, after Linux' SLUB )
+ * Each core owns an active slab whose free bufctls it pops and pushes with
+ * cmpxchg16b on the freelist / tid pair, without disabling interrupts or
+ * taking any lock. tid changes with every operation so an interrupt that
+ * touched the freelist in between makes the exchange fail and retry.
+ * Objects of slabs active on another core go onto that slab's remote list,
+ * everything else ( refills, frees to inactive slabs ) takes the slab lock.
+ * Only compact caches can do this, the bufctl has to be found without the
+ * hash.
+ */
+struct lockless_cpu
+{
+	struct slist_head *freelist; /* nullptr terminated bufctl chain */
+	uint64_t tid;
+	struct slab *active;
+} __attribute__(( aligned( CACHE_LINE_SIZE ) ));
+
 struct slab
 {
+	/* Mode::kLockless - objects freed by other cores while the slab is frozen
+	 * ( active on the core in remote_owner - 1 ), updated by cmpxchg16b */
+	struct slist_head *remote __attribute__(( aligned( 16 ) ));
+	uint64_t remote_owner;
+
 	unsigned refs;
+	unsigned colour;
 
 	void *backing;
 	LIST_LINK( slabs );
@@ -102,10 +173,14 @@ struct bufctl
 		SLIST_LINK( link );
 	};
 
-	LIST_LINK( bufctls );
+	HLIST_NODE( hash );
 	void *data;
 };
 
+/* _cache_cache can't use the external slab and bufctl pools it supplies */
+static_assert( sizeof( struct mem_cache ) < SLAB_MAX_FRAGMENT_SIZE( SLAB_SIZE ),
+               "mem_cache is too large for a compact cache !" );
+
 /* ensure we can cast a bufctl to a bufctl_inline */
 static_assert( offsetof( struct bufctl, slab ) == offsetof( struct bufctl_inline, slab ) &&
                offsetof( struct bufctl, link ) == offsetof( struct bufctl_inline, link ),
@@ -120,8 +195,35 @@ static_assert( offsetof( struct bufctl, slab ) == offsetof( struct bufctl_inline
  * _bufctl_cache - same as _slab_cache but for bufctl structs
  */
 static mem_cache   _cache_cache;
-static mem_cache_t _slab_cache   = nullptr;
-static mem_cache_t _bufctl_cache = nullptr;
+static mem_cache_t _slab_cache     = nullptr;
+static mem_cache_t _bufctl_cache   = nullptr;
+static mem_cache_t _magazine_cache = nullptr;
+
+/* core_local_data::cpu_caches slots in use
+ * A released cache keeps its slot until every core in _cpu_slot_users has
+ * handed back its magazines, _cpu_slot_owner is nullptr from then on. */
+static spin_lock  _cpu_slot_lock;
+static uint32_t   _cpu_slots = 0;
+static uint32_t   _cpu_slot_drain = 0; /* slots of caches being released */
+static uint64_t   _cpu_slot_users[CACHE_CPU_SLOTS]; /* cores holding magazines */
+static mem_cache *_cpu_slot_owner[CACHE_CPU_SLOTS];
+static bool       _cpu_caches_enabled = false;
+#ifndef KERNEL
+static unsigned _host_core = 0; /* stands in for processor::core::current() */
+static unsigned _host_irqs_off = 0; /* nesting of _cpu_cache_enter() */
+static struct cpu_cache _host_cpu_caches[CACHE_MAGAZINE_CORES][CACHE_CPU_SLOTS];
+#endif
+
+static_assert( CACHE_CPU_SLOTS <= 32, "_cpu_slots is too small for CACHE_CPU_SLOTS" );
+static_assert( CACHE_MAGAZINE_CORES <= 64, "_cpu_slot_users is too small for CACHE_MAGAZINE_CORES" );
+
+/* every mem_cache in existence and the subsystems asked to give memory back
+ * when physmm runs low */
+static spin_lock _cache_list_lock;
+static LIST_HEAD( _cache_list ) = LIST_INIT( _cache_list );
+
+static spin_lock       _shrinker_lock;
+static shrink_callback _shrinkers[CACHE_MAX_SHRINKERS];
 
 /* default backing storage allocators */
 #ifdef KERNEL
@@ -134,7 +236,7 @@ _backing_page_alloc( size_t n )
 		/* round up to the nearest multiple of PAGE_SIZE */
 		n += PAGE_SIZE - ( n % PAGE_SIZE );
 	}
-	return physmm::alloc_page_range( n / PAGE_SIZE, __PPF( Locked ) | __PPF( Slab ) );
+	return physmm::alloc_page_range( n / PAGE_SIZE, __PPF( Locked ) | __PPF( Slab ) | __PPF( Zeroed ) );
 }
 
 static void
@@ -166,34 +268,292 @@ extern void  _backing_page_free( void *ptr, size_t n );
 #define BUFCTL_INLINE( buffer, obj_size ) \
 	( ( struct bufctl* )( ( uintptr_t )( buffer )  + obj_size ) )
 
-/* fetch a bufctl from the bufctl-cache */
-#define BUFCTL_EXTERN( cache ) \
-	( ( struct bufctl* )get_object( cache ) )
+/* fetch count bufctls from the bufctl-cache at once */
+#define BUFCTL_EXTERN( cache, count, bufctls ) \
+	get_objects( cache, count, ( void** )( bufctls ) )
+
+/* non-compact caches have objects of at least 1/8th of the slab */
+#define SLAB_MAX_EXTERN_BUFFERS 8
 
 #define BUFFER_MAGIC_SIZE sizeof( uint16_t )
 #define BUFFER_MAGIC_WORD 0xaa55
 
+/* the layout of a cache, read from the cache itself or fixed at compile time
+ * for object_cache<> - the static variant turns the compact / markers checks
+ * of the object paths into constants */
+struct _dynamic_layout
+{
+	static inline bool compact( const mem_cache *cache ) { return cache->compact; }
+	static inline bool markers( const mem_cache *cache ) { return cache->markers; }
+};
+
+template <bool Compact, bool Markers>
+struct _static_layout
+{
+	static constexpr bool compact( const mem_cache* ) { return Compact; }
+	static constexpr bool markers( const mem_cache* ) { return Markers; }
+};
+
+template <typename Layout = _dynamic_layout>
+static inline void
+_check_marker( mem_cache *cache, void *ptr )
+{
+	if( Layout::markers( cache ) )
+	{
+		auto magic = ( uint16_t* )( ( uintptr_t )ptr + cache->obj_size );
+		if( *magic != BUFFER_MAGIC_WORD )
+		{
+			log::printk( "cache::put_object: %p possible overflow (magic: %02x)\n",
+			             ptr, *magic );
+			*magic = BUFFER_MAGIC_WORD;
+		}
+	}
+}
+
+/* bufctl and object of compact caches */
+template <typename Layout = _dynamic_layout>
+static inline struct bufctl*
+_object_bufctl( mem_cache *cache, void *ptr )
+{
+	return BUFCTL_INLINE( ptr, cache->obj_size + ( Layout::markers( cache ) ? BUFFER_MAGIC_SIZE : 0 ) );
+}
+
+template <typename Layout = _dynamic_layout>
+static inline void*
+_bufctl_object( mem_cache *cache, struct bufctl *bufctl )
+{
+	return ( void* )( ( uintptr_t )bufctl - cache->obj_size -
+	                  ( Layout::markers( cache ) ? BUFFER_MAGIC_SIZE : 0 ) );
+}
+
+/* size of a single buffer including alignment and possible inline structures */
+static size_t
+_buffer_size( mem_cache *cache )
+{
+	size_t buff_size;
+
+	buff_size  = cache->obj_size + ( ( cache->compact ) ? sizeof( struct bufctl_inline ) : 0 );
+	buff_size += ( cache->markers ) ? BUFFER_MAGIC_SIZE : 0;
+
+	while( buff_size % cache->obj_align != 0 )
+	{
+		++buff_size;
+	}
+	return buff_size;
+}
+
+/* space of a slab usable for buffers */
+static inline size_t
+_buffer_space( mem_cache *cache )
+{
+	return ( cache->compact == false ) ? cache->alloc_size
+	                                   : cache->alloc_size - sizeof( struct slab );
+}
+
+/* bytes of a slab not covered by buffers */
+static inline size_t
+_slab_waste( mem_cache *cache )
+{
+	size_t buff_size = _buffer_size( cache );
+
+	if( buff_size > _buffer_space( cache ) )
+	{
+		return cache->alloc_size;
+	}
+	return cache->alloc_size - ( _buffer_space( cache ) / buff_size ) * buff_size;
+}
+
+static inline void
+_slab_geometry( mem_cache *cache, size_t alloc_size )
+{
+	cache->alloc_size = alloc_size;
+	cache->compact    = cache->obj_size < SLAB_MAX_FRAGMENT_SIZE( alloc_size );
+}
+
+/* pick the slab size
+ * The candidates are the smallest multiple of SLAB_SIZE that holds an object
+ * followed by the larger SLAB_SIZE << 0..SLAB_MAX_ORDER blocks. The first one
+ * wasting at most SLAB_MAX_WASTE wins, if none does the one wasting the least
+ * relative to its size.
+ */
+static void
+_slab_order( mem_cache *cache )
+{
+	size_t fit = ( cache->obj_size + SLAB_SIZE - 1 ) / SLAB_SIZE * SLAB_SIZE;
+	size_t best_size  = 0,
+	       best_waste = 0; /* per mille */
+
+	fit = ( fit > 0 ) ? fit : SLAB_SIZE;
+	for( int order = -1; order <= SLAB_MAX_ORDER; ++order )
+	{
+		size_t size = ( order < 0 ) ? fit : ( SLAB_SIZE << order );
+
+		if( order >= 0 && size <= fit )
+		{
+			continue;
+		}
+
+		_slab_geometry( cache, size );
+		size_t waste = _slab_waste( cache );
+		if( waste <= SLAB_MAX_WASTE( size ) )
+		{
+			return;
+		}
+		if( best_size == 0 || waste * 1000 / size < best_waste )
+		{
+			best_size  = size;
+			best_waste = waste * 1000 / size;
+		}
+	}
+	_slab_geometry( cache, best_size );
+}
+
+/* split the slack left behind the last buffer of a slab into colours */
+static void
+_colour_init( mem_cache *cache )
+{
+	size_t buff_size = _buffer_size( cache );
+	size_t slack     = 0;
+
+	if( buff_size <= _buffer_space( cache ) )
+	{
+		slack = _buffer_space( cache ) % buff_size;
+	}
+
+	/* colours have to keep the objects aligned */
+	cache->colour_step = ( ( CACHE_LINE_SIZE + cache->obj_align - 1 ) / cache->obj_align ) *
+	                     cache->obj_align;
+	cache->colours     = slack / cache->colour_step + 1;
+	cache->colour_next = 0;
+
+	if( cache->colours > CACHE_MAX_COLOURS )
+	{
+		cache->colours = CACHE_MAX_COLOURS;
+	}
+}
+
+/* obj_hash buckets - there are CACHE_HASH_LOAD bufctls per bucket before
+ * the table is doubled, tables larger than obj_hash_init take whole pages */
+#define CACHE_HASH_LOAD 2
+#define CACHE_HASH_MAX_SHIFT 20
+
+static inline struct hlist_head*
+_hash_bucket( mem_cache *cache, const void *ptr )
+{
+	/* fibonacci hashing, buffers are at least 8 byte aligned which would
+	 * leave the low bits of the address unused by a plain mask */
+	return &cache->obj_hash[( ( uintptr_t )ptr * 0x9e3779b97f4a7c15ULL ) >>
+	                        ( 64 - cache->obj_hash_shift )];
+}
+
+static inline void
+_hash_add( mem_cache *cache, struct bufctl *bufctl )
+{
+	hlist_add( _hash_bucket( cache, bufctl->data ), &bufctl->hash );
+	++cache->obj_hash_count;
+}
+
+static inline void
+_hash_del( mem_cache *cache, struct bufctl *bufctl )
+{
+	hlist_del( &bufctl->hash );
+	--cache->obj_hash_count;
+}
+
+static struct bufctl*
+_hash_lookup( mem_cache *cache, const void *ptr )
+{
+	HLIST_FOREACH( item, _hash_bucket( cache, ptr ) )
+	{
+		auto bufctl = HLIST_ENTRY( item, struct bufctl, hash );
+		if( bufctl->data == ptr )
+		{
+			return bufctl;
+		}
+	}
+	return nullptr;
+}
+
+static inline size_t
+_hash_table_size( unsigned shift )
+{
+	return ( 1UL << shift ) * sizeof( struct hlist_head );
+}
+
+/* double the table until it satisfies CACHE_HASH_LOAD for count bufctls
+ * - failing to grow is not fatal, the chains just get longer */
+static void
+_hash_resize( mem_cache *cache, size_t count )
+{
+	unsigned shift = cache->obj_hash_shift;
+
+	while( ( count >> shift ) >= CACHE_HASH_LOAD && shift < CACHE_HASH_MAX_SHIFT )
+	{
+		++shift;
+	}
+	if( shift == cache->obj_hash_shift )
+	{
+		return;
+	}
+
+	auto table = ( struct hlist_head* )_backing_page_alloc( _hash_table_size( shift ) );
+	if( table == nullptr )
+	{
+		return;
+	}
+
+	auto old_table = cache->obj_hash;
+	auto old_shift = cache->obj_hash_shift;
+
+	/* _backing_page_alloc() hands out zeroed pages, which are empty buckets */
+	cache->obj_hash       = table;
+	cache->obj_hash_shift = shift;
+	for( size_t i = 0; i < ( 1UL << old_shift ); ++i )
+	{
+		HLIST_FOREACH_MUTABLE( item, &old_table[i] )
+		{
+			auto bufctl = HLIST_ENTRY( item, struct bufctl, hash );
+
+			hlist_del( item );
+			hlist_add( _hash_bucket( cache, bufctl->data ), item );
+		}
+	}
+
+	if( old_table != cache->obj_hash_init )
+	{
+		_backing_page_free( old_table, _hash_table_size( old_shift ) );
+	}
+}
+
+/* build a new slab - unlike the rest this runs without mem_cache.lock
+ * held, allocating backing storage may end up in reclaim() */
 static slab*
 _slab_alloc( mem_cache *cache )
 {
 	void *backing = cache->slab_alloc( cache->alloc_size );
 
-	if( cache->slab_alloc == _backing_page_alloc )
+	if( cache->slab_alloc == _backing_page_alloc && backing != nullptr )
 	{
-		/* associate the page to this cache */
-		auto page_map = physmm::get_page_map( __PA( backing ) );
-		if( page_map != nullptr )
+		/* associate the pages to this cache, they were handed out zeroed */
+		for( size_t offset = 0; offset < cache->alloc_size; offset += PAGE_SIZE )
 		{
-			page_map->link.next = ( list_head* )cache;
+			auto page_map = physmm::get_page_map( __PA( backing ) + offset );
+			if( page_map != nullptr )
+			{
+				page_map->link.next = ( list_head* )cache;
+				page_map->slab_tag  = cache->tag;
+			}
 		}
 	}
-	/* never trust your uninitialized RAM.. */
-	memset( backing, 0, cache->alloc_size );
-
-	cache->stats.allocation += cache->alloc_size;
+	else if( backing != nullptr )
+	{
+		/* never trust your uninitialized RAM.. */
+		memset( backing, 0, cache->alloc_size );
+	}
 
 	struct slab *slab;
-	size_t buff_size, buff_avail;
+	struct bufctl *extern_bufctls[SLAB_MAX_EXTERN_BUFFERS];
+	size_t buff_size, buff_avail, colour;
 
 	if( backing == nullptr )
 	{
@@ -213,39 +573,41 @@ _slab_alloc( mem_cache *cache )
 	INIT_LIST( slab->slabs );
 	INIT_SLIST( slab->bufctls );
 
-	/* calculate the size of a single buffer including alignment and possible
-	 * inline structures
-	 */
-	buff_size  = cache->obj_size + ( ( cache->compact ) ? sizeof( struct bufctl_inline ) : 0 );
-	buff_size += ( cache->markers ) ? BUFFER_MAGIC_SIZE : 0;
-
-	while( buff_size % cache->obj_align != 0 )
-	{
-		++buff_size;
-	}
+	/* rotate through the colours of the cache */
+	slab->colour = __atomic_fetch_add( &cache->colour_next, 1, __ATOMIC_RELAXED ) % cache->colours;
+	colour       = slab->colour * cache->colour_step;
 
 	/* calculate the number of buffers in the slab */
-	buff_avail = ( ( cache->compact == false ) ? cache->alloc_size
-	                                           : cache->alloc_size - sizeof( struct slab ) ) / buff_size;
+	buff_size  = _buffer_size( cache );
+	buff_avail = _buffer_space( cache ) / buff_size;
 
 	if( buff_avail == 0 || buff_size > cache->alloc_size )
 	{
 		goto err_no_bufctl;
 	}
 
+	if( !cache->compact )
+	{
+		if( buff_avail > SLAB_MAX_EXTERN_BUFFERS )
+		{
+			goto err_no_bufctl;
+		}
+		auto count = BUFCTL_EXTERN( _bufctl_cache, buff_avail, extern_bufctls );
+		if( count < buff_avail )
+		{
+			put_objects( _bufctl_cache, count, ( void** )extern_bufctls );
+			goto err_no_bufctl;
+		}
+	}
+
 	for( size_t i = 0; i < buff_avail; ++i )
 	{
 		/* fill the slab */
-		auto buffer = ( void* )( ( uintptr_t )backing + buff_size * i );
+		auto buffer = ( void* )( ( uintptr_t )backing + colour + buff_size * i );
 		auto obj_size = cache->obj_size + ( ( cache->markers ) ? BUFFER_MAGIC_SIZE : 0 );
 
 		auto bufctl = ( ( cache->compact ) ? ( BUFCTL_INLINE( buffer, obj_size ) )
-		                                   : ( BUFCTL_EXTERN( _bufctl_cache ) ) );
-
-		if( bufctl == nullptr )
-		{
-			goto err_no_bufctl;
-		}
+		                                   : ( extern_bufctls[i] ) );
 
 		if( cache->markers )
 		{
@@ -260,49 +622,65 @@ _slab_alloc( mem_cache *cache )
 
 		if( !cache->compact )
 		{
-			/* external buffers are linked to be able to look up the buffer
-			 * with only the address */
+			/* external buffers are hashed to be able to look up the buffer
+			 * with only the address, see _slab_link() */
 			bufctl->data = buffer;
-			list_add( &cache->obj_map, &bufctl->bufctls );
 		}
 		slist_add( &slab->bufctls, &bufctl->link );
-
-		++cache->stats.buffers;
 	}
-
-	list_add( &cache->free, &slab->slabs );
-	++cache->stats.slabs;
 	return slab;
 
 /* all the things that may go wrong.. */
 err_no_bufctl:
-	SLIST_FOREACH_MUTABLE( item, &slab->bufctls )
+	/* bufctls are only ever missing before the slab got filled */
+	if( !cache->compact )
 	{
-		auto bufctl = SLIST_ENTRY( item, struct bufctl, link );
-
-		slist_del( &slab->bufctls, &bufctl->link );
-		list_del( &bufctl->bufctls );
-
-		put_object( _bufctl_cache, bufctl );
-		--cache->stats.buffers;
+		put_object( _slab_cache, slab );
 	}
-	put_object( _slab_cache, slab );
 
 err_no_slab:
 	cache->slab_free( backing, cache->alloc_size );
-	cache->stats.allocation -= cache->alloc_size;
 
 err_no_backing:
 	return nullptr;
 }
 
+/* add a slab from _slab_alloc() to the cache */
+static void
+_slab_link( mem_cache *cache, slab *slab )
+{
+	size_t buffers = 0;
+
+	if( !cache->compact )
+	{
+		_hash_resize( cache, cache->obj_hash_count + _buffer_space( cache ) / _buffer_size( cache ) );
+	}
+	SLIST_FOREACH( item, &slab->bufctls )
+	{
+		if( !cache->compact )
+		{
+			_hash_add( cache, SLIST_ENTRY( item, struct bufctl, link ) );
+		}
+		++buffers;
+	}
+
+	list_add( &cache->free, &slab->slabs );
+	cache->stats.allocation += cache->alloc_size;
+	cache->stats.buffers    += buffers;
+	++cache->stats.slabs;
+	++cache->stats.colour_slabs[slab->colour];
+}
+
 static void
 _slab_release( mem_cache *cache, slab *slab )
 {
 	auto backing = slab->backing;
 
+	list_del( &slab->slabs );
 	if( backing != nullptr )
 	{
+		--cache->stats.colour_slabs[slab->colour];
+
 		if( !cache->compact )
 		{
 			/* huge caches need their parts to be returned to the space caches */
@@ -333,20 +711,21 @@ _slab_release( mem_cache *cache, slab *slab )
 				}
 
 				slist_del( &slab->bufctls, &bufctl->link );
-				list_del( &bufctl->bufctls );
+				_hash_del( cache, bufctl );
 
 				put_object( _bufctl_cache, bufctl );
 				--cache->stats.buffers;
 			}
 			put_object( _slab_cache, slab );
-			--cache->stats.slabs;
 		}
 		/* the rest is as simple as releasing the backing storage */
+		--cache->stats.slabs;
 		cache->slab_free( backing, cache->alloc_size );
 		cache->stats.allocation -= cache->alloc_size;
 	}
 }
 
+template <typename Layout = _dynamic_layout>
 static void*
 _slab_get_object( mem_cache *cache, slab *slab )
 {
@@ -357,13 +736,9 @@ _slab_get_object( mem_cache *cache, slab *slab )
 		slist_del( &slab->bufctls, &bufctl->link );
 		bufctl->slab = slab;
 		++slab->refs;
-		if( cache->compact )
+		if( Layout::compact( cache ) )
 		{
-			if( cache->markers )
-			{
-				return ( void* )( ( uintptr_t )bufctl - ( cache->obj_size + BUFFER_MAGIC_SIZE ) );
-			}
-			return ( void* )( ( uintptr_t )bufctl - ( cache->obj_size ) );
+			return _bufctl_object<Layout>( cache, bufctl );
 		}
 		else
 		{
@@ -396,44 +771,24 @@ _slab_empty( slab *slab )
 	return slab->refs == 0;
 }
 
+/* move a slab to the list matching its state
+ * only called when an allocation or free made it cross the empty, partial
+ * or full boundary, so each operation touches at most this one slab */
 static void
-_cache_sort( mem_cache *cache )
+_cache_relink( mem_cache *cache, slab *slab )
 {
-	/* migrate partial slabs from the full list */
-	LIST_FOREACH_MUTABLE( ptr, &cache->full )
+	list_del( &slab->slabs );
+	if( _slab_full( slab ) )
 	{
-		auto slab = LIST_ENTRY( ptr, struct slab, slabs );
-		if( !_slab_full( slab ) )
-		{
-			list_del( ptr );
-			list_add_tail( &cache->used, ptr );
-		}
+		list_add_tail( &cache->full, &slab->slabs );
 	}
-	/* migrate partial slabs from the free list */
-	LIST_FOREACH_MUTABLE( ptr, &cache->free )
+	else if( _slab_empty( slab ) )
 	{
-		auto slab = LIST_ENTRY( ptr, struct slab, slabs );
-		if( !_slab_empty( slab ) )
-		{
-			list_del( ptr );
-			list_add_tail( &cache->used, ptr );
-		}
+		list_add_tail( &cache->free, &slab->slabs );
 	}
-
-	/* migrate empty or full slabs from the used list */
-	LIST_FOREACH_MUTABLE( ptr, &cache->used )
+	else
 	{
-		auto slab = LIST_ENTRY( ptr, struct slab, slabs );
-		if( _slab_full( slab ) )
-		{
-			list_del( ptr );
-			list_add_tail( &cache->full, ptr );
-		}
-		else if( _slab_empty( slab ) )
-		{
-			list_del( ptr );
-			list_add_tail( &cache->free, ptr );
-		}
+		list_add_tail( &cache->used, &slab->slabs );
 	}
 }
 
@@ -450,108 +805,949 @@ _cache_init( mem_cache *cache, const char *name, size_t size, size_t align,
 	cache->obj_erase  = erase;
 	cache->slab_alloc = ( back_alloc ) ? back_alloc : _backing_page_alloc;
 	cache->slab_free  = ( back_free )  ? back_free  : _backing_page_free;
-	cache->alloc_size = SLAB_SIZE;
-	while( cache->alloc_size < size )
-	{
-		cache->alloc_size += SLAB_SIZE;
-	}
-	cache->compact    = cache->obj_size < SLAB_MAX_FRAGMENT_SIZE( cache->alloc_size );
 	cache->markers    = check_overflow;
+	cache->tag        = 0;
+
+	_slab_order( cache );
+	_colour_init( cache );
+
+	cache->magazine_size = 0;
+	cache->cpu_slot      = -1;
+	cache->lockless      = nullptr;
+	cache->depot_full    = nullptr;
+	cache->depot_empty   = nullptr;
 
 	memset( &cache->stats, 0, sizeof( mem_cache_stats_t ) );
+	cache->stats.colours    = cache->colours;
+	cache->stats.slab_size  = cache->alloc_size;
+	cache->stats.slab_waste = _slab_waste( cache );
 
 	INIT_LIST( cache->free );
 	INIT_LIST( cache->used );
 	INIT_LIST( cache->full );
-	INIT_LIST( cache->obj_map );
+
+	cache->obj_hash       = cache->obj_hash_init;
+	cache->obj_hash_shift = CACHE_HASH_INIT_SHIFT;
+	cache->obj_hash_count = 0;
+	for( auto &bucket : cache->obj_hash_init )
+	{
+		INIT_HLIST_HEAD( bucket );
+	}
 }
 
-void*
-get_object( mem_cache_t cache )
+/* take up to count objects from the slabs, a slab is drained as far as
+ * possible before it is relinked */
+template <typename Layout = _dynamic_layout>
+static unsigned
+_cache_fill( mem_cache *cache, unsigned count, void *objects[] )
 {
-	void *object;
-	LIST_HEAD( *slab_list );
-
-	cache->lock.lock();
+	unsigned n = 0;
 
-	if( list_empty( &cache->used ) )
+	while( n < count )
 	{
-		if( list_empty( &cache->free ) )
+		LIST_HEAD( *slab_list );
+
+		if( list_empty( &cache->used ) )
 		{
-			/* need more slabs.. */
-			if( _slab_alloc( cache ) == nullptr )
+			if( list_empty( &cache->free ) )
 			{
-				return nullptr;
+				/* need more slabs.. */
+				cache->lock.unlock();
+				auto slab = _slab_alloc( cache );
+				cache->lock.lock();
+
+				if( slab == nullptr )
+				{
+					break;
+				}
+				_slab_link( cache, slab );
+				++cache->stats.cache_misses;
+				--cache->stats.cache_hits; /* compensate for the ++ below */
 			}
-			++cache->stats.cache_misses;
-			--cache->stats.cache_hits; /* compensate for the ++ below */
+			slab_list = &cache->free;
+		}
+		else
+		{
+			slab_list = &cache->used;
 		}
-		slab_list = &cache->free;
-	}
-	else
-	{
-		slab_list = &cache->used;
-	}
 
-	object = _slab_get_object( cache, LIST_HEAD_ENTRY( slab_list, struct slab, slabs ) );
-	if( object )
-	{
-		++cache->stats.cache_hits;
-		_cache_sort( cache );
-	}
+		auto slab = LIST_HEAD_ENTRY( slab_list, struct slab, slabs );
+		while( n < count && !_slab_full( slab ) )
+		{
+			objects[n++] = _slab_get_object<Layout>( cache, slab );
+			++cache->stats.cache_hits;
+		}
 
-	cache->lock.unlock();
-	return object;
+		/* free slabs become partial ( or full ), partial ones may fill up */
+		if( slab_list == &cache->free || _slab_full( slab ) )
+		{
+			_cache_relink( cache, slab );
+		}
+	}
+	return n;
 }
 
-void
-put_object( mem_cache_t cache, void *ptr )
+/* return a single object to its slab */
+template <typename Layout = _dynamic_layout>
+static void
+_cache_release( mem_cache *cache, void *ptr )
 {
 	struct bufctl *bufctl = nullptr;
-	uint16_t *magic = nullptr;
-
-	cache->lock.lock();
 
-	if( cache->compact )
+	if( Layout::compact( cache ) )
 	{
 		/* no need for hash lookups, we can access the bufctl from ptr */
-		bufctl = BUFCTL_INLINE( ptr, cache->obj_size + ( ( cache->markers ) ? BUFFER_MAGIC_SIZE : 0 ) );
+		bufctl = _object_bufctl<Layout>( cache, ptr );
 	}
 	else
 	{
-		/* FIXME: hash lookup would be nice */
-		LIST_FOREACH( item, &cache->obj_map )
-		{
-			bufctl = ( struct bufctl* )LIST_ENTRY( item, struct bufctl, bufctls );
-			if( bufctl->data == ptr )
-			{
-				break;
-			}
-			bufctl = nullptr;
-		}
+		bufctl = _hash_lookup( cache, ptr );
 	}
 
 	if( bufctl != nullptr )
 	{
-		if( cache->markers )
+		_check_marker<Layout>( cache, ptr );
+
+		auto slab     = bufctl->slab;
+		bool was_full = _slab_full( slab );
+
+		_slab_put_object( slab, bufctl );
+
+		/* frozen slabs ( Mode::kLockless ) are relinked by their unfreeze */
+		if( ( was_full || _slab_empty( slab ) ) && slab->remote_owner == 0 )
 		{
-			magic = ( uint16_t* )( ( uintptr_t )ptr + cache->obj_size );
-			if( *magic != BUFFER_MAGIC_WORD )
-			{
-				log::printk( "cache::put_object: %p possible overflow (magic: %02x)\n",
-				             ptr, *magic );
-				*magic = BUFFER_MAGIC_WORD;
-			}
+			_cache_relink( cache, slab );
 		}
-		_slab_put_object( bufctl->slab, bufctl );
-		_cache_sort( cache );
 	}
+}
 
-	cache->lock.unlock();
+static inline uint64_t
+_cpu_cache_enter( void )
+{
+#ifdef KERNEL
+	uint64_t state = processor::core::read_flags();
+	processor::core::disable_interrupts();
+	return state;
+#else
+	++_host_irqs_off;
+	return 0;
+#endif
 }
 
-#undef BUFCTL_INLINE
-#undef BUFCTL_EXTERN
+static inline void
+_cpu_cache_leave( uint64_t state )
+{
+#ifdef KERNEL
+	processor::core::write_flags( state );
+#else
+	( void )state;
+	--_host_irqs_off;
+#endif
+}
+
+/* scoped_lock for cache->lock - _lockless_refill() takes the lock of a
+ * Mode::kLockless cache from interrupts, so it's only ever held with
+ * interrupts disabled there */
+class cache_lock
+{
+public:
+	cache_lock( mem_cache *cache ) : _cache{cache}, _state{0}
+	{
+		if( _cache->lockless != nullptr )
+		{
+			_state = _cpu_cache_enter();
+		}
+		_cache->lock.lock();
+	};
+
+	~cache_lock()
+	{
+		_cache->lock.unlock();
+		if( _cache->lockless != nullptr )
+		{
+			_cpu_cache_leave( _state );
+		}
+	}
+private:
+	mem_cache *_cache;
+	uint64_t _state;
+};
+
+/* slab layer part of get_object() */
+template <typename Layout = _dynamic_layout>
+static void*
+_cache_get_object( mem_cache *cache )
+{
+	void *object = nullptr;
+	cache_lock lock( cache );
+
+	_cache_fill<Layout>( cache, 1, &object );
+	return object;
+}
+
+/* slab layer part of put_object() */
+template <typename Layout = _dynamic_layout>
+static void
+_cache_put_object( mem_cache *cache, void *ptr )
+{
+	cache_lock lock( cache );
+
+	_cache_release<Layout>( cache, ptr );
+}
+
+static inline unsigned
+_cpu_id( void )
+{
+#ifdef KERNEL
+	return processor::core::current()->id;
+#else
+	return _host_core;
+#endif
+}
+
+/* the local magazines in slot or nullptr if the core has none */
+static inline struct cpu_cache*
+_cpu_cache_slot( unsigned slot )
+{
+	auto id = _cpu_id();
+	if( id >= CACHE_MAGAZINE_CORES )
+	{
+		return nullptr;
+	}
+#ifdef KERNEL
+	return &processor::core::current()->cpu_caches[slot];
+#else
+	return &_host_cpu_caches[id][slot];
+#endif
+}
+
+/* the local magazines of cache or nullptr if it has none */
+static inline struct cpu_cache*
+_cpu_cache( mem_cache *cache )
+{
+	if( !_cpu_caches_enabled || cache->cpu_slot < 0 )
+	{
+		return nullptr;
+	}
+	return _cpu_cache_slot( cache->cpu_slot );
+}
+
+/* note that the local core holds magazines of cache */
+static inline void
+_cpu_cache_loaded( mem_cache *cache )
+{
+	uint64_t bit = 1ULL << _cpu_id();
+	auto users   = &_cpu_slot_users[cache->cpu_slot];
+
+	if( ( __atomic_load_n( users, __ATOMIC_RELAXED ) & bit ) == 0 )
+	{
+		__atomic_or_fetch( users, bit, __ATOMIC_RELAXED );
+	}
+}
+
+/* make slot available to create() - expects _cpu_slot_lock to be held */
+static void
+_cpu_slot_free( unsigned slot )
+{
+	_cpu_slots            &= ~( 1U << slot );
+	_cpu_slot_drain       &= ~( 1U << slot );
+	_cpu_slot_owner[slot]  = nullptr;
+	_cpu_slot_users[slot]  = 0;
+}
+
+static void _magazine_release( mem_cache *cache, struct magazine *mag );
+static void _depot_drain( mem_cache *cache );
+
+/* hand back the magazines the local core holds for caches being released
+ * Runs from the magazine layer with interrupts disabled, so it only tries
+ * the locks and leaves busy slots for the next call. */
+static void
+_cpu_cache_drain( void )
+{
+	uint64_t bit = 1ULL << _cpu_id();
+
+	if( !_cpu_slot_lock.try_lock() )
+	{
+		return;
+	}
+
+	uint32_t drain = _cpu_slot_drain;
+	while( drain != 0 )
+	{
+		unsigned slot = __builtin_ctz( drain );
+		auto owner    = _cpu_slot_owner[slot];
+		auto cc       = _cpu_cache_slot( slot );
+
+		drain &= drain - 1;
+		if( cc == nullptr || ( _cpu_slot_users[slot] & bit ) == 0 )
+		{
+			continue;
+		}
+		if( owner != nullptr && !owner->lock.try_lock() )
+		{
+			continue;
+		}
+
+		struct magazine *mags[2] = { cc->loaded, cc->previous };
+		cc->loaded   = nullptr;
+		cc->previous = nullptr;
+
+		for( auto mag : mags )
+		{
+			if( mag == nullptr )
+			{
+				continue;
+			}
+			if( owner != nullptr )
+			{
+				_magazine_release( owner, mag );
+			}
+			else
+			{
+				/* the cache is gone, any objects went with its slabs */
+				mag->rounds = 0;
+				put_object( _magazine_cache, mag );
+			}
+		}
+		if( owner != nullptr )
+		{
+			/* a put racing the release may have filled the depot again */
+			_depot_drain( owner );
+			owner->lock.unlock();
+		}
+
+		_cpu_slot_users[slot] &= ~bit;
+		if( owner == nullptr && _cpu_slot_users[slot] == 0 )
+		{
+			_cpu_slot_free( slot );
+		}
+	}
+	_cpu_slot_lock.unlock();
+}
+
+static inline void
+_depot_push( struct magazine **list, struct magazine *mag )
+{
+	mag->next = *list;
+	*list     = mag;
+}
+
+static inline struct magazine*
+_depot_pop( struct magazine **list )
+{
+	auto mag = *list;
+
+	if( mag != nullptr )
+	{
+		*list = mag->next;
+	}
+	return mag;
+}
+
+static void*
+_magazine_get( mem_cache *cache )
+{
+	void *object   = nullptr;
+	uint64_t state = _cpu_cache_enter();
+
+	if( __atomic_load_n( &_cpu_slot_drain, __ATOMIC_RELAXED ) != 0 )
+	{
+		_cpu_cache_drain();
+	}
+
+	auto cc = _cpu_cache( cache );
+
+	for( ;; )
+	{
+		if( cc->loaded != nullptr && cc->loaded->rounds > 0 )
+		{
+			object = cc->loaded->objs[--cc->loaded->rounds];
+			break;
+		}
+		if( cc->previous != nullptr && cc->previous->rounds > 0 )
+		{
+			auto mag     = cc->loaded;
+			cc->loaded   = cc->previous;
+			cc->previous = mag;
+			continue;
+		}
+
+		/* both are empty - trade one of them for a full magazine */
+		scoped_lock lock( cache->depot_lock );
+		auto full = _depot_pop( &cache->depot_full );
+		if( full == nullptr )
+		{
+			break;
+		}
+		if( cc->previous != nullptr )
+		{
+			_depot_push( &cache->depot_empty, cc->previous );
+		}
+		cc->previous = cc->loaded;
+		cc->loaded   = full;
+		_cpu_cache_loaded( cache );
+	}
+
+	_cpu_cache_leave( state );
+	return object;
+}
+
+static bool
+_magazine_put( mem_cache *cache, void *object )
+{
+	bool stored    = false;
+	uint64_t state = _cpu_cache_enter();
+
+	if( __atomic_load_n( &_cpu_slot_drain, __ATOMIC_RELAXED ) != 0 )
+	{
+		_cpu_cache_drain();
+	}
+
+	auto cc       = _cpu_cache( cache );
+	unsigned size = cache->magazine_size; /* set_magazine_size() may change it */
+
+	while( size > 0 )
+	{
+		if( cc->loaded != nullptr && cc->loaded->rounds < size )
+		{
+			cc->loaded->objs[cc->loaded->rounds++] = object;
+			stored = true;
+			break;
+		}
+		if( cc->previous != nullptr && cc->previous->rounds < size )
+		{
+			auto mag     = cc->loaded;
+			cc->loaded   = cc->previous;
+			cc->previous = mag;
+			continue;
+		}
+
+		/* both are full - trade one of them for an empty magazine */
+		struct magazine *empty;
+		{
+			scoped_lock lock( cache->depot_lock );
+			empty = _depot_pop( &cache->depot_empty );
+		}
+		if( empty == nullptr )
+		{
+			empty = ( struct magazine* )get_object( _magazine_cache );
+			if( empty == nullptr )
+			{
+				break;
+			}
+			empty->rounds = 0;
+		}
+		if( cc->previous != nullptr )
+		{
+			scoped_lock lock( cache->depot_lock );
+			_depot_push( &cache->depot_full, cc->previous );
+		}
+		cc->previous = cc->loaded;
+		cc->loaded   = empty;
+		_cpu_cache_loaded( cache );
+	}
+
+	_cpu_cache_leave( state );
+	return stored;
+}
+
+/* return the objects of a magazine to the slab layer and free it
+ * - expects mem_cache.lock to be held */
+static void
+_magazine_release( mem_cache *cache, struct magazine *mag )
+{
+	while( mag->rounds > 0 )
+	{
+		_cache_release( cache, mag->objs[--mag->rounds] );
+	}
+	put_object( _magazine_cache, mag );
+}
+
+/* empty the depot - expects mem_cache.lock to be held */
+static void
+_depot_drain( mem_cache *cache )
+{
+	struct magazine *mags[2] = { nullptr, nullptr };
+
+	{
+		scoped_lock lock( cache->depot_lock );
+		mags[0] = cache->depot_full;
+		mags[1] = cache->depot_empty;
+		cache->depot_full  = nullptr;
+		cache->depot_empty = nullptr;
+	}
+	for( auto mag : mags )
+	{
+		while( mag != nullptr )
+		{
+			auto next = mag->next;
+			_magazine_release( cache, mag );
+			mag = next;
+		}
+	}
+}
+
+/* empty the depot and the magazines of the local core
+ * magazines loaded by other cores are left alone */
+static void
+_magazine_flush( mem_cache *cache )
+{
+	struct magazine *mags[2] = { nullptr, nullptr };
+
+	if( _cpu_cache( cache ) != nullptr )
+	{
+		uint64_t state = _cpu_cache_enter();
+		auto cc        = _cpu_cache( cache );
+		mags[0] = cc->loaded;
+		mags[1] = cc->previous;
+		cc->loaded   = nullptr;
+		cc->previous = nullptr;
+		__atomic_and_fetch( &_cpu_slot_users[cache->cpu_slot], ~( 1ULL << _cpu_id() ),
+		                    __ATOMIC_RELAXED );
+		_cpu_cache_leave( state );
+	}
+
+	scoped_lock lock( cache->lock );
+	_depot_drain( cache );
+	for( auto mag : mags )
+	{
+		if( mag != nullptr )
+		{
+			_magazine_release( cache, mag );
+		}
+	}
+}
+
+/* compare and exchange the 16 byte pair at ptr */
+static inline bool
+_cmpxchg16b( void *ptr, void *old_ptr, uint64_t old_val, void *new_ptr, uint64_t new_val )
+{
+	bool equal;
+
+	__asm__ __volatile__(
+		"lock cmpxchg16b %1\n"
+		"setz %0\n"
+		: "=q"( equal ), "+m"( *( volatile uint64_t( * )[2] )ptr ),
+		  "+a"( old_ptr ), "+d"( old_val )
+		: "b"( new_ptr ), "c"( new_val )
+		: "memory", "cc"
+	);
+	return equal;
+}
+
+/* the lockless state of the local core or nullptr if the cache has none */
+static inline struct lockless_cpu*
+_lockless_cpu( mem_cache *cache )
+{
+	if( cache->lockless == nullptr || !_cpu_caches_enabled )
+	{
+		return nullptr;
+	}
+	auto id = _cpu_id();
+	return ( id < CACHE_LOCKLESS_CORES ) ? &cache->lockless[id] : nullptr;
+}
+
+/* hand all free bufctls of slab to lc - expects mem_cache.lock to be held
+ * and interrupts disabled */
+static void
+_lockless_freeze( struct lockless_cpu *lc, struct slab *slab, uint64_t owner )
+{
+	struct slist_head *chain = nullptr,
+	                  *next  = slab->bufctls.next;
+
+	list_del( &slab->slabs );
+	INIT_LIST( slab->slabs );
+
+	/* the circular slist becomes a nullptr terminated chain */
+	while( next != &slab->bufctls )
+	{
+		auto bufctl = next;
+
+		next         = bufctl->next;
+		bufctl->next = chain;
+		chain        = bufctl;
+		++slab->refs;
+	}
+	INIT_SLIST( slab->bufctls );
+
+	slab->remote       = nullptr;
+	slab->remote_owner = owner;
+
+	lc->active   = slab;
+	lc->freelist = chain;
+	++lc->tid;
+}
+
+/* give the active slab of lc back to the cache - expects mem_cache.lock to be
+ * held and interrupts disabled */
+static void
+_lockless_unfreeze( mem_cache *cache, struct lockless_cpu *lc )
+{
+	auto slab  = lc->active;
+	auto chain = lc->freelist;
+
+	if( slab == nullptr )
+	{
+		return;
+	}
+
+	lc->active   = nullptr;
+	lc->freelist = nullptr;
+	++lc->tid;
+
+	/* stop remote frees, they take the locked path from now on */
+	struct slist_head *remote;
+	uint64_t owner;
+	do
+	{
+		remote = __atomic_load_n( &slab->remote, __ATOMIC_ACQUIRE );
+		owner  = slab->remote_owner;
+	} while( !_cmpxchg16b( &slab->remote, remote, owner, nullptr, 0 ) );
+
+	struct slist_head *lists[] = { chain, remote };
+	for( auto list : lists )
+	{
+		while( list != nullptr )
+		{
+			auto next = list->next;
+			slist_add( &slab->bufctls, list );
+			--slab->refs;
+			list = next;
+		}
+	}
+
+	/* frozen slabs aren't on any list */
+	_cache_relink( cache, slab );
+}
+
+/* refill the freelist of the local core
+ * from the remote frees of its active slab or by freezing another slab */
+static bool
+_lockless_refill( mem_cache *cache, struct lockless_cpu *lc )
+{
+	uint64_t state = _cpu_cache_enter();
+	bool refilled  = false;
+
+	cache->lock.lock();
+
+	while( !refilled )
+	{
+		auto slab = lc->active;
+
+		if( lc->freelist != nullptr )
+		{
+			/* an interrupt got here first */
+			refilled = true;
+		}
+		else if( slab != nullptr &&
+		         __atomic_load_n( &slab->remote, __ATOMIC_ACQUIRE ) != nullptr )
+		{
+			struct slist_head *remote;
+			do
+			{
+				remote = __atomic_load_n( &slab->remote, __ATOMIC_ACQUIRE );
+			} while( !_cmpxchg16b( &slab->remote, remote, slab->remote_owner,
+			                       nullptr, slab->remote_owner ) );
+
+			lc->freelist = remote;
+			++lc->tid;
+			refilled = true;
+		}
+		else
+		{
+			/* the active slab is all used up */
+			_lockless_unfreeze( cache, lc );
+
+			if( list_empty( &cache->used ) && list_empty( &cache->free ) )
+			{
+				cache->lock.unlock();
+				slab = _slab_alloc( cache );
+				cache->lock.lock();
+
+				if( slab == nullptr )
+				{
+					break;
+				}
+				_slab_link( cache, slab );
+				++cache->stats.cache_misses;
+			}
+			else
+			{
+				++cache->stats.cache_hits;
+			}
+
+			slab = LIST_HEAD_ENTRY( list_empty( &cache->used ) ? &cache->free : &cache->used,
+			                        struct slab, slabs );
+			_lockless_freeze( lc, slab, ( uint64_t )( lc - cache->lockless ) + 1 );
+		}
+	}
+	cache->lock.unlock();
+
+	_cpu_cache_leave( state );
+	return refilled;
+}
+
+/* lc stays the local state, cores don't migrate between the loads and
+ * the exchange - interrupts may run in between though */
+template <typename Layout = _dynamic_layout>
+static void*
+_lockless_get( mem_cache *cache, struct lockless_cpu *lc )
+{
+	for( ;; )
+	{
+		uint64_t tid = __atomic_load_n( &lc->tid, __ATOMIC_ACQUIRE );
+		auto head    = lc->freelist;
+		auto slab    = lc->active;
+
+		if( head == nullptr )
+		{
+			if( !_lockless_refill( cache, lc ) )
+			{
+				return nullptr;
+			}
+			continue;
+		}
+
+		/* head->next may be stale if an interrupt took head meanwhile,
+		 * the changed tid lets the exchange fail in that case */
+		if( _cmpxchg16b( &lc->freelist, head, tid, head->next, tid + 1 ) )
+		{
+			auto bufctl  = SLIST_ENTRY( head, struct bufctl, link );
+			bufctl->slab = slab;
+			return _bufctl_object<Layout>( cache, bufctl );
+		}
+	}
+}
+
+/* frees to a slab active on another core ( or none ), also taken by cores
+ * without a lockless_cpu of their own */
+template <typename Layout = _dynamic_layout>
+static void
+_lockless_put_remote( mem_cache *cache, struct bufctl *bufctl, void *ptr )
+{
+	auto slab = bufctl->slab;
+
+	for( ;; )
+	{
+		auto remote = __atomic_load_n( &slab->remote, __ATOMIC_ACQUIRE );
+		auto owner  = __atomic_load_n( &slab->remote_owner, __ATOMIC_ACQUIRE );
+
+		if( owner == 0 )
+		{
+			/* frozen or not is stable while the lock is held */
+			cache_lock lock( cache );
+			if( slab->remote_owner == 0 )
+			{
+				bufctl->slab = slab;
+				_cache_release<Layout>( cache, ptr );
+				return;
+			}
+			continue;
+		}
+
+		bufctl->link.next = remote;
+		if( _cmpxchg16b( &slab->remote, remote, owner, &bufctl->link, owner ) )
+		{
+			return;
+		}
+	}
+}
+
+template <typename Layout = _dynamic_layout>
+static void
+_lockless_put( mem_cache *cache, struct lockless_cpu *lc, void *ptr )
+{
+	auto bufctl = _object_bufctl<Layout>( cache, ptr );
+	auto slab   = bufctl->slab;
+
+	_check_marker<Layout>( cache, ptr );
+
+	/* local frees to the active slab */
+	for( ;; )
+	{
+		uint64_t tid = __atomic_load_n( &lc->tid, __ATOMIC_ACQUIRE );
+		auto head    = lc->freelist;
+
+		if( lc->active != slab )
+		{
+			break;
+		}
+
+		bufctl->link.next = head;
+		if( _cmpxchg16b( &lc->freelist, head, tid, &bufctl->link, tid + 1 ) )
+		{
+			return;
+		}
+	}
+	_lockless_put_remote<Layout>( cache, bufctl, ptr );
+}
+
+/* give the active slab of the local core back, other cores keep theirs */
+static void
+_lockless_flush( mem_cache *cache )
+{
+	auto lc = _lockless_cpu( cache );
+	if( lc != nullptr )
+	{
+		uint64_t state = _cpu_cache_enter();
+
+		cache->lock.lock();
+		_lockless_unfreeze( cache, lc );
+		cache->lock.unlock();
+
+		_cpu_cache_leave( state );
+	}
+}
+
+/* give the active slabs of all cores back - only for release(), the other
+ * cores are done with the cache by then */
+static void
+_lockless_flush_all( mem_cache *cache )
+{
+	if( cache->lockless == nullptr )
+	{
+		return;
+	}
+
+	uint64_t state = _cpu_cache_enter();
+
+	cache->lock.lock();
+	for( unsigned i = 0; i < CACHE_LOCKLESS_CORES; ++i )
+	{
+		_lockless_unfreeze( cache, &cache->lockless[i] );
+	}
+	cache->lock.unlock();
+
+	_cpu_cache_leave( state );
+}
+
+/* default magazine size, smaller objects are cheaper to keep around */
+static inline unsigned
+_magazine_default_size( size_t obj_size )
+{
+	return ( obj_size <= 256  ) ? CACHE_MAGAZINE_MAX :
+	       ( obj_size <= 2048 ) ? CACHE_MAGAZINE_MAX / 2 : CACHE_MAGAZINE_MAX / 8;
+}
+
+template <typename Layout = _dynamic_layout>
+static void*
+_get_object( mem_cache *cache )
+{
+	auto lc = _lockless_cpu( cache );
+	if( lc != nullptr )
+	{
+		return _lockless_get<Layout>( cache, lc );
+	}
+	if( _cpu_cache( cache ) != nullptr && cache->magazine_size > 0 )
+	{
+		auto object = _magazine_get( cache );
+		if( object != nullptr )
+		{
+			return object;
+		}
+	}
+	return _cache_get_object<Layout>( cache );
+}
+
+template <typename Layout = _dynamic_layout>
+static void
+_put_object( mem_cache *cache, void *ptr )
+{
+	if( cache->lockless != nullptr )
+	{
+		auto lc = _lockless_cpu( cache );
+		if( lc != nullptr )
+		{
+			_lockless_put<Layout>( cache, lc, ptr );
+		}
+		else
+		{
+			/* the slab may be frozen by any other core */
+			_check_marker<Layout>( cache, ptr );
+			_lockless_put_remote<Layout>( cache, _object_bufctl<Layout>( cache, ptr ), ptr );
+		}
+		return;
+	}
+	if( _cpu_cache( cache ) != nullptr && cache->magazine_size > 0 )
+	{
+		/* objects may sit in a magazine for a while, check them now */
+		_check_marker<Layout>( cache, ptr );
+		if( _magazine_put( cache, ptr ) )
+		{
+			return;
+		}
+	}
+	_cache_put_object<Layout>( cache, ptr );
+}
+
+void*
+get_object( mem_cache_t cache )
+{
+	return _get_object( cache );
+}
+
+void
+put_object( mem_cache_t cache, void *ptr )
+{
+	_put_object( cache, ptr );
+}
+
+template <bool Compact, bool Markers>
+void*
+get_object( mem_cache_t cache )
+{
+	return _get_object<_static_layout<Compact, Markers>>( cache );
+}
+
+template <bool Compact, bool Markers>
+void
+put_object( mem_cache_t cache, void *ptr )
+{
+	_put_object<_static_layout<Compact, Markers>>( cache, ptr );
+}
+
+/* the layouts object_cache<> may ask for */
+template void *get_object<false, false>( mem_cache_t cache );
+template void *get_object<false, true>( mem_cache_t cache );
+template void *get_object<true, false>( mem_cache_t cache );
+template void *get_object<true, true>( mem_cache_t cache );
+
+template void put_object<false, false>( mem_cache_t cache, void *ptr );
+template void put_object<false, true>( mem_cache_t cache, void *ptr );
+template void put_object<true, false>( mem_cache_t cache, void *ptr );
+template void put_object<true, true>( mem_cache_t cache, void *ptr );
+
+unsigned
+get_objects( mem_cache_t cache, unsigned count, void *objects[] )
+{
+	cache_lock lock( cache );
+
+	return _cache_fill( cache, count, objects );
+}
+
+void
+put_objects( mem_cache_t cache, unsigned count, void *const objects[] )
+{
+	if( cache->lockless != nullptr )
+	{
+		/* the objects may belong to frozen slabs */
+		for( unsigned i = 0; i < count; ++i )
+		{
+			put_object( cache, objects[i] );
+		}
+		return;
+	}
+
+	scoped_lock lock( cache->lock );
+
+	for( unsigned i = 0; i < count; ++i )
+	{
+		_cache_release( cache, objects[i] );
+	}
+}
+
+#undef BUFCTL_INLINE
+#undef BUFCTL_EXTERN
 
 #undef SLAB_INLINE
 #undef SLAB_EXTERN
@@ -559,7 +1755,7 @@ put_object( mem_cache_t cache, void *ptr )
 mem_cache_t
 create( const char *name, size_t size, size_t align, bool check_overflow,
         cache_obj_setup setup, cache_obj_erase erase,
-        backend_alloc back_alloc, backend_free back_free )
+        backend_alloc back_alloc, backend_free back_free, Mode mode )
 {
 	mem_cache_t cache = ( mem_cache_t )get_object( &_cache_cache );
 
@@ -573,14 +1769,82 @@ create( const char *name, size_t size, size_t align, bool check_overflow,
 
 		_cache_init( cache, name, size, align, check_overflow,
 		             setup, erase, back_alloc, back_free );
+
+		{
+			scoped_lock lock( _cache_list_lock );
+			list_add_tail( &_cache_list, &cache->caches );
+		}
+
+		if( mode == Mode::kLockless )
+		{
+			/* frees have to find the bufctl without the hash */
+			if( cache->compact )
+			{
+				cache->lockless = ( struct lockless_cpu* )_backing_page_alloc(
+					sizeof( struct lockless_cpu ) * CACHE_LOCKLESS_CORES );
+			}
+			if( cache->lockless != nullptr )
+			{
+				memset( cache->lockless, 0, sizeof( struct lockless_cpu ) * CACHE_LOCKLESS_CORES );
+				return cache;
+			}
+			log::printk( "cache::create: '%s' can't be lockless, using magazines\n", name );
+		}
+
+		/* the internal caches are created before _magazine_cache and do
+		 * without magazines, as do caches beyond CACHE_CPU_SLOTS */
+		if( _magazine_cache != nullptr )
+		{
+			scoped_lock lock( _cpu_slot_lock );
+			if( ~_cpu_slots != 0 )
+			{
+				cache->cpu_slot      = __builtin_ctz( ~_cpu_slots );
+				cache->magazine_size = _magazine_default_size( size );
+				_cpu_slots          |= 1U << cache->cpu_slot;
+
+				_cpu_slot_owner[cache->cpu_slot] = cache;
+				_cpu_slot_users[cache->cpu_slot] = 0;
+			}
+		}
 	}
 	return cache;
 }
 
+bool
+set_magazine_size( mem_cache_t cache, unsigned size )
+{
+	if( cache->cpu_slot < 0 || size > CACHE_MAGAZINE_MAX )
+	{
+		return false;
+	}
+
+	/* shrinking magazines would leave overfull ones behind */
+	cache->magazine_size = 0;
+	_magazine_flush( cache );
+	cache->magazine_size = size;
+	return true;
+}
+
+/* release all free slabs, returns the number of pages given back */
+static size_t
+_cache_shrink( mem_cache *cache )
+{
+	size_t allocation = cache->stats.allocation;
+
+	LIST_FOREACH_MUTABLE( item, &cache->free )
+	{
+		_slab_release( cache, LIST_ENTRY( item, struct slab, slabs ) );
+	}
+	return ( allocation - cache->stats.allocation ) / PAGE_SIZE;
+}
+
 bool
 reap( mem_cache_t cache )
 {
-	scoped_lock lock( cache->lock );
+	_magazine_flush( cache );
+	_lockless_flush( cache );
+
+	cache_lock lock( cache );
 
 	/* try to reclaim space by releasing free slabs */
 	if( list_empty( &cache->free ) )
@@ -588,18 +1852,100 @@ reap( mem_cache_t cache )
 		return false;
 	}
 
-	LIST_FOREACH_MUTABLE( item, &cache->free )
+	_cache_shrink( cache );
+	return true;
+}
+
+size_t
+reclaim( size_t pages )
+{
+	size_t freed = 0;
+
+	/* caches busy on this ( or any other ) core are skipped, the allocation
+	 * that got us here might be holding their lock */
+	_cache_list_lock.lock();
+	LIST_FOREACH( item, &_cache_list )
 	{
-		_slab_release( cache, LIST_ENTRY( item, struct slab, slabs ) );
+		auto cache = LIST_ENTRY( item, struct mem_cache, caches );
+
+		/* see cache_lock */
+		uint64_t state = ( cache->lockless != nullptr ) ? _cpu_cache_enter() : 0;
+		if( cache->lock.try_lock() )
+		{
+			_depot_drain( cache );
+			freed += _cache_shrink( cache );
+			cache->lock.unlock();
+		}
+		if( cache->lockless != nullptr )
+		{
+			_cpu_cache_leave( state );
+		}
+		if( freed >= pages )
+		{
+			break;
+		}
+	}
+	_cache_list_lock.unlock();
+
+	for( unsigned i = 0; i < CACHE_MAX_SHRINKERS && freed < pages; ++i )
+	{
+		auto shrink = __atomic_load_n( &_shrinkers[i], __ATOMIC_ACQUIRE );
+		if( shrink != nullptr )
+		{
+			freed += shrink( pages - freed );
+		}
+	}
+	return freed;
+}
+
+bool
+register_shrinker( shrink_callback shrink )
+{
+	scoped_lock lock( _shrinker_lock );
+
+	for( auto &slot : _shrinkers )
+	{
+		if( slot == nullptr )
+		{
+			__atomic_store_n( &slot, shrink, __ATOMIC_RELEASE );
+			return true;
+		}
+	}
+	return false;
+}
+
+void
+unregister_shrinker( shrink_callback shrink )
+{
+	scoped_lock lock( _shrinker_lock );
+
+	for( auto &slot : _shrinkers )
+	{
+		if( slot == shrink )
+		{
+			__atomic_store_n( &slot, nullptr, __ATOMIC_RELEASE );
+		}
 	}
-	return true;
 }
 
 bool
 release( mem_cache_t cache, bool force )
 {
+	/* no more magazines get loaded, other cores hand back theirs on their
+	 * next trip through the magazine layer - until then their objects
+	 * count as allocated, as do those of slabs active on any core */
+	if( cache->cpu_slot >= 0 )
 	{
-		scoped_lock lock( cache->lock );
+		cache->magazine_size = 0;
+
+		scoped_lock lock( _cpu_slot_lock );
+		_cpu_slot_drain |= 1U << cache->cpu_slot;
+	}
+	_magazine_flush( cache );
+	_lockless_flush_all( cache );
+
+	{
+		cache_lock lock( cache );
 
 		if( ( !list_empty( &cache->full )   ||
 			  !list_empty( &cache->used ) ) &&
@@ -609,6 +1955,28 @@ release( mem_cache_t cache, bool force )
 			             cache->name );
 			return false;
 		}
+	}
+	if( cache->cpu_slot >= 0 )
+	{
+		/* magazines still loaded elsewhere are empty ( or forced ), the last
+		 * core to hand them back frees the slot */
+		scoped_lock lock( _cpu_slot_lock );
+		if( _cpu_slot_users[cache->cpu_slot] == 0 )
+		{
+			_cpu_slot_free( cache->cpu_slot );
+		}
+		else
+		{
+			_cpu_slot_owner[cache->cpu_slot] = nullptr;
+		}
+	}
+	{
+		/* out of reach for reclaim() from here on */
+		scoped_lock list_lock( _cache_list_lock );
+		list_del( &cache->caches );
+	}
+	{
+		cache_lock lock( cache );
 
 		if( force )
 		{
@@ -630,6 +1998,15 @@ release( mem_cache_t cache, bool force )
 			_slab_release( cache, LIST_ENTRY( item, struct slab, slabs ) );
 		}
 	}
+
+	if( cache->obj_hash != cache->obj_hash_init )
+	{
+		_backing_page_free( cache->obj_hash, _hash_table_size( cache->obj_hash_shift ) );
+	}
+	if( cache->lockless != nullptr )
+	{
+		_backing_page_free( cache->lockless, sizeof( struct lockless_cpu ) * CACHE_LOCKLESS_CORES );
+	}
 	put_object( &_cache_cache, cache );
 
 	return true;
@@ -638,9 +2015,8 @@ release( mem_cache_t cache, bool force )
 void
 stats( mem_cache_t cache, mem_cache_stats_t &statbuf )
 {
-	cache->lock.lock();
+	cache_lock lock( cache );
 	memcpy( &statbuf, &cache->stats, sizeof( mem_cache_stats_t ) );
-	cache->lock.unlock();
 }
 
 mem_cache_t get_cache( void *ptr )
@@ -656,14 +2032,53 @@ mem_cache_t get_cache( void *ptr )
 	return nullptr;
 }
 
+void
+set_tag( mem_cache_t cache, uint8_t tag )
+{
+	cache->tag = tag;
+}
+
+uint8_t
+get_tag( void *ptr )
+{
+	if( ptr != nullptr )
+	{
+		auto map = physmm::get_page_map( __PA( ptr ) );
+		if( map != nullptr && flag_set( map->flags, __PPF( Slab ) ) )
+		{
+			return map->slab_tag;
+		}
+	}
+	return 0;
+}
+
 void
 init( void )
 {
 	log::printk( "Initializing SLAB object cache..\n" );
 	_cache_init( &_cache_cache, "cache::cache-pool", sizeof( struct mem_cache ), 4 );
+	list_add_tail( &_cache_list, &_cache_cache.caches );
 
-	_slab_cache   = create( "cache::slab-pool", sizeof( struct slab ), 4 );
-	_bufctl_cache = create( "cache::bufctl-pool", sizeof( struct bufctl ), 4 );
+	_slab_cache     = create( "cache::slab-pool", sizeof( struct slab ), alignof( struct slab ) );
+	_bufctl_cache   = create( "cache::bufctl-pool", sizeof( struct bufctl ), 4 );
+	_magazine_cache = create( "cache::magazine-pool", sizeof( struct magazine ), 8 );
+
+#ifdef KERNEL
+	physmm::set_reclaim_callback( reclaim );
+#endif
+}
+
+void
+init_cpu_cache( void )
+{
+	_cpu_caches_enabled = true;
+
+#ifdef KERNEL
+	memset( processor::core::current()->cpu_caches, 0,
+	        sizeof( processor::core::current()->cpu_caches ) );
+#else
+	memset( _host_cpu_caches, 0, sizeof( _host_cpu_caches ) );
+#endif
 }
 
 };
@@ -19,12 +19,16 @@
 
 *******************************************************************************/
 
-/* kmalloc / kfree / krealloc */
+/* kmalloc / kfree / krealloc / kmalloc_bulk / kfree_bulk */
 
 #include <string.h>
 #include <hotarubi/types.h>
+#include <hotarubi/lock.h>
+#include <hotarubi/memory/page.h>
 
 #include <hotarubi/memory/cache.h>
+#include <hotarubi/memory/vmalloc.h>
+#include <hotarubi/memory/kmalloc_profile.h>
 #include <hotarubi/log/log.h>
 
 struct kmalloc_cache
@@ -33,88 +37,276 @@ struct kmalloc_cache
 	memory::cache::mem_cache_t cache;
 };
 
-static kmalloc_cache _kmalloc_cache_table[] = {
-	{    32, nullptr },
-	{    64, nullptr },
-	{   128, nullptr },
-	{   256, nullptr },
-	{   512, nullptr },
-	{  1024, nullptr },
-	{  2048, nullptr },
-	{  3072, nullptr },
-	{  4096, nullptr },
-	{  8192, nullptr },
-	{ 12288, nullptr },
-	{ 16384, nullptr },
-	/* bigger stuff should be allocated in other ways ( for now ) */
-	{     0, nullptr }
+/* size classes, the 1.5x steps keep the slack of odd sizes below a third */
+static constexpr size_t _kmalloc_sizes[] = {
+	   32,    48,    64,    96,   128,   192,   256,   384,
+	  512,   768,  1024,  1536,  2048,  3072,  4096,  8192,
+	12288, 16384
+	/* bigger stuff is handed to vmalloc */
 };
 
-static const char *_kmalloc_cache_names[] = {
+#define KMALLOC_CLASSES ( sizeof( _kmalloc_sizes ) / sizeof( _kmalloc_sizes[0] ) )
+#define KMALLOC_MAX_SIZE _kmalloc_sizes[KMALLOC_CLASSES - 1]
+
+/* row 0 holds the default caches ( 16 byte aligned ), row i the ones aligned
+ * to 16 << i - those are created on first use */
+#define KMALLOC_MIN_ALIGN 16
+#define KMALLOC_ALIGNS    9 /* 16 .. PAGE_SIZE */
+
+static kmalloc_cache _kmalloc_cache_table[KMALLOC_ALIGNS][KMALLOC_CLASSES];
+static spin_lock _kmalloc_aligned_lock;
+
+static const char *_kmalloc_aligned_prefixes[KMALLOC_ALIGNS] = {
+	nullptr,
+	"kmalloc::aligned-32/",
+	"kmalloc::aligned-64/",
+	"kmalloc::aligned-128/",
+	"kmalloc::aligned-256/",
+	"kmalloc::aligned-512/",
+	"kmalloc::aligned-1024/",
+	"kmalloc::aligned-2048/",
+	"kmalloc::aligned-4096/",
+};
+
+/* "kmalloc::aligned-<align>/size-<class>" of the caches created on demand */
+#define KMALLOC_NAME_MAX 40
+static char _kmalloc_aligned_names[KMALLOC_ALIGNS][KMALLOC_CLASSES][KMALLOC_NAME_MAX];
+
+static const char *_kmalloc_cache_names[KMALLOC_CLASSES] = {
 	"kmalloc::size-32",
+	"kmalloc::size-48",
 	"kmalloc::size-64",
+	"kmalloc::size-96",
 	"kmalloc::size-128",
+	"kmalloc::size-192",
 	"kmalloc::size-256",
+	"kmalloc::size-384",
 	"kmalloc::size-512",
+	"kmalloc::size-768",
 	"kmalloc::size-1024",
+	"kmalloc::size-1536",
 	"kmalloc::size-2048",
 	"kmalloc::size-3072",
 	"kmalloc::size-4096",
 	"kmalloc::size-8192",
 	"kmalloc::size-12288",
 	"kmalloc::size-16384",
-	"\0",
 };
 
+/* size to class lookup
+ * Sizes up to 256 are looked up in 16 byte steps, larger ones in 128 byte
+ * steps - every class is a multiple of its step, so the tables are exact.
+ * Both tables are generated at compile time from _kmalloc_sizes.
+ */
+#define KMALLOC_SMALL_MAX   256
+#define KMALLOC_SMALL_SHIFT 4
+#define KMALLOC_LARGE_SHIFT 7
+
+static constexpr uint8_t
+_kmalloc_class( size_t n, size_t i = 0 )
+{
+	return ( i + 1 >= KMALLOC_CLASSES || n <= _kmalloc_sizes[i] ) ? i : _kmalloc_class( n, i + 1 );
+}
+
+static constexpr bool
+_kmalloc_exact( size_t i = 0 )
+{
+	return i >= KMALLOC_CLASSES ||
+	       ( _kmalloc_sizes[i] % ( 1 << ( ( _kmalloc_sizes[i] <= KMALLOC_SMALL_MAX ) ? KMALLOC_SMALL_SHIFT
+	                                                                             : KMALLOC_LARGE_SHIFT ) ) == 0 &&
+	         _kmalloc_exact( i + 1 ) );
+}
+
+static_assert( _kmalloc_exact(), "kmalloc classes have to be multiples of their lookup step" );
+
+template <size_t... I> struct _kmalloc_index_list {};
+
+template <size_t N, size_t... I>
+struct _kmalloc_make_index : _kmalloc_make_index<N - 1, N - 1, I...> {};
+
+template <size_t... I>
+struct _kmalloc_make_index<0, I...>
+{
+	typedef _kmalloc_index_list<I...> type;
+};
+
+template <size_t Shift, typename List> struct _kmalloc_index;
+
+template <size_t Shift, size_t... I>
+struct _kmalloc_index<Shift, _kmalloc_index_list<I...>>
+{
+	static constexpr uint8_t table[] = { _kmalloc_class( I << Shift )... };
+};
+
+template <size_t Shift, size_t... I>
+constexpr uint8_t _kmalloc_index<Shift, _kmalloc_index_list<I...>>::table[];
+
+typedef _kmalloc_index<KMALLOC_SMALL_SHIFT,
+        _kmalloc_make_index<( KMALLOC_SMALL_MAX >> KMALLOC_SMALL_SHIFT ) + 1>::type> _kmalloc_small_index;
+typedef _kmalloc_index<KMALLOC_LARGE_SHIFT,
+        _kmalloc_make_index<( KMALLOC_MAX_SIZE >> KMALLOC_LARGE_SHIFT ) + 1>::type> _kmalloc_large_index;
 
+static_assert( KMALLOC_ALIGNS * KMALLOC_CLASSES < 256, "kmalloc tags have to fit a page_map_t" );
+
+/* the slab pages of each cache are tagged with its table index + 1 */
 static inline kmalloc_cache*
 _lookup_cache_for_ptr( void *ptr )
 {
-	auto cache = memory::cache::get_cache( ptr );
-	if( cache != nullptr )
+	auto tag = memory::cache::get_tag( ptr );
+	return ( tag > 0 && tag <= KMALLOC_ALIGNS * KMALLOC_CLASSES )
+	       ? &_kmalloc_cache_table[0][0] + tag - 1 : nullptr;
+}
+
+static inline kmalloc_cache*
+_lookup_cache_for_size( size_t n )
+{
+	if( n <= KMALLOC_SMALL_MAX )
+	{
+		return &_kmalloc_cache_table[0][_kmalloc_small_index::table[
+		                                ( n + ( 1 << KMALLOC_SMALL_SHIFT ) - 1 ) >> KMALLOC_SMALL_SHIFT]];
+	}
+	if( n <= KMALLOC_MAX_SIZE )
+	{
+		return &_kmalloc_cache_table[0][_kmalloc_large_index::table[
+		                                ( n + ( 1 << KMALLOC_LARGE_SHIFT ) - 1 ) >> KMALLOC_LARGE_SHIFT]];
+	}
+	return nullptr;
+}
+
+/* table row of align, 0 for the default alignment */
+static inline unsigned
+_kmalloc_align_row( size_t align )
+{
+	return ( align <= KMALLOC_MIN_ALIGN ) ? 0 : 64 - __builtin_clzll( align - 1 ) - 4;
+}
+
+/* the alignment a cache was created with */
+static inline size_t
+_kmalloc_align_of( kmalloc_cache *cache )
+{
+	return KMALLOC_MIN_ALIGN << ( ( cache - &_kmalloc_cache_table[0][0] ) / KMALLOC_CLASSES );
+}
+
+/* class of n in the row of align without creating its cache */
+static kmalloc_cache*
+_lookup_aligned_class( size_t n, size_t align )
+{
+	unsigned row = _kmalloc_align_row( align );
+
+	if( row == 0 )
 	{
-		for( size_t i = 0; _kmalloc_cache_table[i].size; ++i )
+		return _lookup_cache_for_size( n );
+	}
+	if( row >= KMALLOC_ALIGNS )
+	{
+		return nullptr;
+	}
+
+	align     = KMALLOC_MIN_ALIGN << row;
+	auto base = _lookup_cache_for_size( ( n + align - 1 ) & ~( align - 1 ) );
+	if( base == nullptr )
+	{
+		return nullptr;
+	}
+	return &_kmalloc_cache_table[row][base - _kmalloc_cache_table[0]];
+}
+
+/* class of n in the row of align, aligned caches are created on demand */
+static kmalloc_cache*
+_lookup_cache_for_size( size_t n, size_t align )
+{
+	auto cache = _lookup_aligned_class( n, align );
+	if( cache == nullptr )
+	{
+		return nullptr;
+	}
+
+	if( __atomic_load_n( &cache->cache, __ATOMIC_ACQUIRE ) == nullptr )
+	{
+		scoped_lock lock( _kmalloc_aligned_lock );
+		if( cache->cache == nullptr )
 		{
-			if( cache == _kmalloc_cache_table[i].cache )
+			unsigned row   = _kmalloc_align_row( align );
+			unsigned index = cache - _kmalloc_cache_table[row];
+			auto base      = &_kmalloc_cache_table[0][index];
+			auto name      = _kmalloc_aligned_names[row][index];
+
+			/* the class name goes behind the alignment, minus "kmalloc::" */
+			strcpy( name, _kmalloc_aligned_prefixes[row] );
+			strcat( name, _kmalloc_cache_names[index] + 9 );
+
+			align       = KMALLOC_MIN_ALIGN << row;
+			size_t size = ( base->size + align - 1 ) & ~( align - 1 );
+			auto res    = memory::cache::create( name, size, align, size < 1024 );
+			if( res == nullptr )
 			{
-				return &_kmalloc_cache_table[i];
+				return nullptr;
 			}
+			memory::cache::set_tag( res, cache - &_kmalloc_cache_table[0][0] + 1 );
+			cache->size = size;
+			__atomic_store_n( &cache->cache, res, __ATOMIC_RELEASE );
 		}
 	}
-	return nullptr;
+	return cache;
 }
 
-static inline kmalloc_cache*
-_lookup_cache_for_size( size_t n )
+static inline void*
+_kmalloc( size_t n )
 {
-	for( size_t i = 0; _kmalloc_cache_table[i].size; ++i )
+	auto cache = _lookup_cache_for_size( n );
+	if( cache != nullptr )
+	{
+		auto res = memory::cache::get_object( cache->cache );
+		if( res != nullptr )
+		{
+			return ( void* )res;
+		}
+	}
+	else
 	{
-		if( n <= _kmalloc_cache_table[i].size )
+		auto res = vmalloc( n );
+		if( res != nullptr )
 		{
-			return &_kmalloc_cache_table[i];
+			return res;
 		}
 	}
+	log::printk( "kmalloc: can't serve request for %zd bytes!\n", n );
 	return nullptr;
 }
 
-void*
-kmalloc( size_t n )
+static inline void*
+_kmalloc_aligned( size_t n, size_t align )
 {
-	auto cache = _lookup_cache_for_size( n );
+	if( align <= KMALLOC_MIN_ALIGN )
+	{
+		return _kmalloc( n );
+	}
+
+	auto cache = _lookup_cache_for_size( n, align );
 	if( cache != nullptr )
 	{
 		auto res = memory::cache::get_object( cache->cache );
 		if( res != nullptr )
 		{
-			return ( void* )res;
+			return res;
 		}
 	}
-	log::printk( "kmalloc: can't serve request for %zd bytes!\n", n );
+	else if( align <= PAGE_SIZE )
+	{
+		/* vmalloc ranges are page aligned */
+		auto res = vmalloc( n );
+		if( res != nullptr )
+		{
+			return res;
+		}
+	}
+	log::printk( "kmalloc_aligned: can't serve request for %zd bytes aligned to %zd!\n",
+	             n, align );
 	return nullptr;
 }
 
-void
-kfree( void *ptr )
+static inline void
+_kfree( void *ptr )
 {
 	if( ptr == nullptr )
 	{
@@ -128,26 +320,189 @@ kfree( void *ptr )
 		memory::cache::put_object( cache, ptr );
 		return;
 	}
+	if( memory::vmalloc::owns( ptr ) )
+	{
+		vfree( ptr );
+		return;
+	}
 	panic( "kfree: attempting to free %p which is not managed by kmalloc!",
 	       ptr );
 }
 
+/* the public entry points record their caller when profiling */
 void*
-krealloc( void *ptr, size_t n )
+kmalloc( size_t n )
+{
+	void *res = _kmalloc( n );
+	KMALLOC_PROFILE_ALLOC( res, n );
+	return res;
+}
+
+void*
+kmalloc_aligned( size_t n, size_t align )
+{
+	void *res = _kmalloc_aligned( n, align );
+	KMALLOC_PROFILE_ALLOC( res, n );
+	return res;
+}
+
+void*
+kmalloc_at( size_t n, uintptr_t site )
+{
+	void *res = _kmalloc( n );
+	KMALLOC_PROFILE_ALLOC_AT( res, n, site );
+	return res;
+}
+
+void*
+kmalloc_aligned_at( size_t n, size_t align, uintptr_t site )
+{
+	void *res = _kmalloc_aligned( n, align );
+	KMALLOC_PROFILE_ALLOC_AT( res, n, site );
+	return res;
+}
+
+void
+kfree( void *ptr )
+{
+	KMALLOC_PROFILE_FREE( ptr );
+	_kfree( ptr );
+}
+
+void
+kfree_sized( void *ptr, size_t n, size_t align )
+{
+	if( ptr == nullptr )
+	{
+		panic( "kfree_sized: attempting to free a nullptr!" );
+		return;
+	}
+	KMALLOC_PROFILE_FREE( ptr );
+
+	/* the class follows from n, no need to look at the page map - freeing
+	 * must not allocate, so a missing aligned cache is never created here */
+	auto cache = _lookup_aligned_class( n, align );
+	if( cache != nullptr )
+	{
+		auto res = __atomic_load_n( &cache->cache, __ATOMIC_ACQUIRE );
+		if( res == nullptr )
+		{
+			panic( "kfree_sized: no cache for %p of %zd bytes aligned to %zd!",
+			       ptr, n, align );
+			return;
+		}
+		memory::cache::put_object( res, ptr );
+		return;
+	}
+	_kfree( ptr );
+}
+
+unsigned
+kmalloc_bulk( size_t n, unsigned count, void *ptrs[] )
+{
+	auto cache = _lookup_cache_for_size( n );
+	if( cache != nullptr )
+	{
+		auto res = memory::cache::get_objects( cache->cache, count, ptrs );
+		for( unsigned i = 0; i < res; ++i )
+		{
+			KMALLOC_PROFILE_ALLOC( ptrs[i], n );
+		}
+		if( res < count )
+		{
+			log::printk( "kmalloc_bulk: served %u of %u requests for %zd bytes!\n",
+			             res, count, n );
+		}
+		return res;
+	}
+	log::printk( "kmalloc_bulk: can't serve requests for %zd bytes!\n", n );
+	return 0;
+}
+
+void
+kfree_bulk( unsigned count, void *const ptrs[] )
+{
+	unsigned first = 0;
+
+	for( unsigned i = 0; i < count; ++i )
+	{
+		KMALLOC_PROFILE_FREE( ptrs[i] );
+	}
+
+	/* hand runs of pointers from the same cache back at once */
+	while( first < count )
+	{
+		if( ptrs[first] == nullptr )
+		{
+			panic( "kfree_bulk: attempting to free a nullptr!" );
+			return;
+		}
+
+		auto cache = memory::cache::get_cache( ptrs[first] );
+		if( cache == nullptr && memory::vmalloc::owns( ptrs[first] ) )
+		{
+			vfree( ptrs[first++] );
+			continue;
+		}
+		if( cache == nullptr )
+		{
+			panic( "kfree_bulk: attempting to free %p which is not managed by kmalloc!",
+			       ptrs[first] );
+			return;
+		}
+
+		unsigned last = first + 1;
+		while( last < count && ptrs[last] != nullptr &&
+		       memory::cache::get_cache( ptrs[last] ) == cache )
+		{
+			++last;
+		}
+		memory::cache::put_objects( cache, last - first, &ptrs[first] );
+		first = last;
+	}
+}
+
+static inline void*
+_krealloc( void *ptr, size_t n )
 {
 	if( ptr == nullptr )
 	{
-		return kmalloc( n );
+		return _kmalloc( n );
 	}
 
 	auto cache = _lookup_cache_for_ptr( ptr );
 	if( cache != nullptr )
 	{
-		void *res = kmalloc( n );
+		size_t align = _kmalloc_align_of( cache );
+
+		if( _lookup_cache_for_size( n, align ) == cache )
+		{
+			/* same class, nothing to move */
+			return ptr;
+		}
+
+		void *res = _kmalloc_aligned( n, align );
 		if( res != nullptr )
 		{
 			memcpy( res, ptr, ( n > cache->size ) ? cache->size : n );
-			memory::cache::put_object( cache->cache, cache );
+			memory::cache::put_object( cache->cache, ptr );
+			return res;
+		}
+	}
+	else if( memory::vmalloc::owns( ptr ) && memory::vmalloc::size( ptr ) > 0 )
+	{
+		size_t size = memory::vmalloc::size( ptr );
+		if( n <= size )
+		{
+			/* shrinking keeps the mapping */
+			return ptr;
+		}
+
+		void *res = _kmalloc( n );
+		if( res != nullptr )
+		{
+			memcpy( res, ptr, size );
+			vfree( ptr );
 			return res;
 		}
 	}
@@ -156,6 +511,19 @@ krealloc( void *ptr, size_t n )
 	return ptr;
 }
 
+void*
+krealloc( void *ptr, size_t n )
+{
+	void *res = _krealloc( ptr, n );
+	if( res != ptr )
+	{
+		/* objects resized in place stay with their original site */
+		KMALLOC_PROFILE_FREE( ptr );
+		KMALLOC_PROFILE_ALLOC( res, n );
+	}
+	return res;
+}
+
 namespace memory
 {
 namespace kmalloc
@@ -164,16 +532,17 @@ namespace kmalloc
 void
 init( void )
 {
-	for( size_t i = 0; _kmalloc_cache_table[i].size; ++i )
+	for( size_t i = 0; i < KMALLOC_CLASSES; ++i )
 	{
-		bool overflow_check = ( _kmalloc_cache_table[i].size < 1024 );
+		bool overflow_check = ( _kmalloc_sizes[i] < 1024 );
+		auto cache          = &_kmalloc_cache_table[0][i];
 
-		auto cache = memory::cache::create( _kmalloc_cache_names[i],
-		                                    _kmalloc_cache_table[i].size,
-		                                    16, overflow_check );
-		if( cache != nullptr )
+		cache->size  = _kmalloc_sizes[i];
+		cache->cache = memory::cache::create( _kmalloc_cache_names[i], _kmalloc_sizes[i],
+		                                      KMALLOC_MIN_ALIGN, overflow_check );
+		if( cache->cache != nullptr )
 		{
-			_kmalloc_cache_table[i].cache = cache;
+			memory::cache::set_tag( cache->cache, i + 1 );
 		}
 	}
 }
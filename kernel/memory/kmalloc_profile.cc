@@ -0,0 +1,427 @@
+/*******************************************************************************
+
+    Copyright (C) 2014  René 'Shirk' Köcher
+ 
+    This file is part of Hotarubi.
+
+    Hotarubi is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+ 
+    Hotarubi is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+ 
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*******************************************************************************/
+
+
+
+/* kmalloc allocation-site profiler
+ *
+ * The counters per call site live in per core tables which are only touched
+ * with interrupts disabled by the owning core, dump() sums them up.
+ * A free has to find the site and size of the object though, and objects
+ * are freed on other cores than the one that allocated them often enough.
+ * So every live object is kept in a table shared by all cores, split into
+ * KMALLOC_PROFILE_SHARDS open addressed shards by pointer hash, each with a
+ * lock of its own to keep the cores from serialising on a single one.
+ * Objects allocated before init() or while their shard is full are not
+ * tracked.
+ */
+
+#ifdef KMALLOC_PROFILE
+
+#include <string.h>
+#include <hotarubi/types.h>
+#include <hotarubi/lock.h>
+#include <hotarubi/log/log.h>
+
+#include <hotarubi/memory/vmalloc.h>
+#include <hotarubi/memory/kmalloc_profile.h>
+
+#ifdef KERNEL
+#include <hotarubi/processor/core.h>
+#endif
+
+#define KMALLOC_PROFILE_CORES    64
+#define KMALLOC_PROFILE_SITES    512   /* per core, power of 2 */
+#define KMALLOC_PROFILE_OBJECTS  65536 /* power of 2 */
+#define KMALLOC_PROFILE_SHARDS   64    /* power of 2 */
+#define KMALLOC_PROFILE_SHARD_OBJECTS ( KMALLOC_PROFILE_OBJECTS / KMALLOC_PROFILE_SHARDS )
+#define KMALLOC_PROFILE_DUMP_MAX 32
+
+namespace memory
+{
+namespace kmalloc_profile
+{
+
+struct live_object
+{
+	uintptr_t ptr;
+	uintptr_t site;
+	size_t size;
+};
+
+struct object_shard
+{
+	spin_lock lock;
+	size_t count;
+	struct live_object *objects;
+} __attribute__(( aligned( 64 ) ));
+
+static struct object_shard _profile_shards[KMALLOC_PROFILE_SHARDS];
+static struct site_stats *_profile_sites = nullptr;
+static uint64_t _profile_dropped = 0;
+static bool _profile_cores_enabled = false;
+
+static inline size_t
+_profile_hash( uintptr_t value )
+{
+	return ( value * 0x9e3779b97f4a7c15ull ) >> 32;
+}
+
+static inline uint64_t
+_profile_enter( void )
+{
+#ifdef KERNEL
+	uint64_t state = processor::core::read_flags();
+	processor::core::disable_interrupts();
+	return state;
+#else
+	return 0;
+#endif
+}
+
+static inline void
+_profile_leave( uint64_t state )
+{
+#ifdef KERNEL
+	processor::core::write_flags( state );
+#else
+	( void )state;
+#endif
+}
+
+/* the site table of core, nullptr for cores beyond KMALLOC_PROFILE_CORES */
+static inline struct site_stats*
+_profile_core_sites( unsigned core )
+{
+	if( core >= KMALLOC_PROFILE_CORES )
+	{
+		return nullptr;
+	}
+	return &_profile_sites[core * KMALLOC_PROFILE_SITES];
+}
+
+static inline struct site_stats*
+_profile_local_sites( void )
+{
+#ifdef KERNEL
+	/* %gs is valid once the cores are set up, only the BSP runs before */
+	if( !_profile_cores_enabled )
+	{
+		return _profile_core_sites( 0 );
+	}
+	return _profile_core_sites( processor::core::current()->id );
+#else
+	return _profile_core_sites( 0 );
+#endif
+}
+
+/* entry for site in table, optionally claiming a free one */
+static struct site_stats*
+_profile_site( struct site_stats *table, uintptr_t site, bool create )
+{
+	size_t slot = _profile_hash( site ) & ( KMALLOC_PROFILE_SITES - 1 );
+
+	for( size_t i = 0; i < KMALLOC_PROFILE_SITES; ++i )
+	{
+		auto entry = &table[slot];
+		if( entry->site == site )
+		{
+			return entry;
+		}
+		if( entry->site == 0 )
+		{
+			if( !create )
+			{
+				return nullptr;
+			}
+			entry->site = site;
+			return entry;
+		}
+		slot = ( slot + 1 ) & ( KMALLOC_PROFILE_SITES - 1 );
+	}
+	return nullptr;
+}
+
+/* the shard holding ptr, the low bits of the hash pick the slot in it */
+static inline struct object_shard*
+_profile_shard( uintptr_t ptr )
+{
+	size_t hash = _profile_hash( ptr ) / KMALLOC_PROFILE_SHARD_OBJECTS;
+	return &_profile_shards[hash & ( KMALLOC_PROFILE_SHARDS - 1 )];
+}
+
+/* expects shard->lock to be held */
+static bool
+_profile_object_insert( struct object_shard *shard, uintptr_t ptr, uintptr_t site, size_t size )
+{
+	size_t mask = KMALLOC_PROFILE_SHARD_OBJECTS - 1;
+
+	/* keep the probe sequences short */
+	if( shard->count >= KMALLOC_PROFILE_SHARD_OBJECTS / 4 * 3 )
+	{
+		return false;
+	}
+
+	size_t slot = _profile_hash( ptr ) & mask;
+	while( shard->objects[slot].ptr != 0 && shard->objects[slot].ptr != ptr )
+	{
+		slot = ( slot + 1 ) & mask;
+	}
+	if( shard->objects[slot].ptr == 0 )
+	{
+		++shard->count;
+	}
+	shard->objects[slot] = { ptr, site, size };
+	return true;
+}
+
+/* remove ptr and return its record, expects shard->lock to be held */
+static bool
+_profile_object_remove( struct object_shard *shard, uintptr_t ptr, struct live_object *object )
+{
+	auto objects = shard->objects;
+	size_t mask  = KMALLOC_PROFILE_SHARD_OBJECTS - 1;
+	size_t slot  = _profile_hash( ptr ) & mask;
+
+	while( objects[slot].ptr != ptr )
+	{
+		if( objects[slot].ptr == 0 )
+		{
+			return false;
+		}
+		slot = ( slot + 1 ) & mask;
+	}
+	*object = objects[slot];
+
+	/* shift the following entries back instead of leaving a tombstone */
+	for( size_t next = ( slot + 1 ) & mask; objects[next].ptr != 0;
+	     next = ( next + 1 ) & mask )
+	{
+		size_t home = _profile_hash( objects[next].ptr ) & mask;
+		bool stays  = ( slot <= next ) ? ( slot < home && home <= next )
+		                               : ( slot < home || home <= next );
+		if( !stays )
+		{
+			objects[slot] = objects[next];
+			slot          = next;
+		}
+	}
+	objects[slot].ptr = 0;
+	--shard->count;
+	return true;
+}
+
+void
+record_alloc( const void *ptr, size_t n, uintptr_t site )
+{
+	if( ptr == nullptr || _profile_sites == nullptr )
+	{
+		return;
+	}
+
+	uint64_t state = _profile_enter();
+	auto shard     = _profile_shard( ( uintptr_t )ptr );
+
+	shard->lock.lock();
+	bool tracked = _profile_object_insert( shard, ( uintptr_t )ptr, site, n );
+	shard->lock.unlock();
+
+	auto table = _profile_local_sites();
+	auto entry = ( tracked && table != nullptr ) ? _profile_site( table, site, true )
+	                                             : nullptr;
+	if( entry != nullptr )
+	{
+		entry->allocs += 1;
+		entry->live += n;
+	}
+	else
+	{
+		__atomic_add_fetch( &_profile_dropped, 1, __ATOMIC_RELAXED );
+	}
+
+	_profile_leave( state );
+}
+
+void
+record_free( const void *ptr )
+{
+	if( ptr == nullptr || _profile_sites == nullptr )
+	{
+		return;
+	}
+
+	struct live_object object;
+	uint64_t state = _profile_enter();
+	auto shard     = _profile_shard( ( uintptr_t )ptr );
+
+	shard->lock.lock();
+	bool tracked = _profile_object_remove( shard, ( uintptr_t )ptr, &object );
+	shard->lock.unlock();
+
+	if( tracked )
+	{
+		auto table = _profile_local_sites();
+		auto entry = ( table != nullptr ) ? _profile_site( table, object.site, true )
+		                                  : nullptr;
+		if( entry != nullptr )
+		{
+			entry->frees += 1;
+			entry->live -= object.size;
+		}
+		else
+		{
+			__atomic_add_fetch( &_profile_dropped, 1, __ATOMIC_RELAXED );
+		}
+	}
+
+	_profile_leave( state );
+}
+
+unsigned
+collect( unsigned top, struct site_stats stats[] )
+{
+	unsigned count = 0;
+
+	if( _profile_sites == nullptr )
+	{
+		return 0;
+	}
+
+	for( unsigned core = 0; core < KMALLOC_PROFILE_CORES; ++core )
+	{
+		auto table = _profile_core_sites( core );
+		for( size_t i = 0; i < KMALLOC_PROFILE_SITES; ++i )
+		{
+			uintptr_t site = table[i].site;
+			if( site == 0 )
+			{
+				continue;
+			}
+
+			/* sites seen on an earlier core have been summed up already */
+			bool seen = false;
+			for( unsigned prev = 0; prev < core && !seen; ++prev )
+			{
+				seen = ( _profile_site( _profile_core_sites( prev ), site, false ) != nullptr );
+			}
+			if( seen )
+			{
+				continue;
+			}
+
+			struct site_stats sum = { site, 0, 0, 0 };
+			for( unsigned other = core; other < KMALLOC_PROFILE_CORES; ++other )
+			{
+				auto entry = _profile_site( _profile_core_sites( other ), site, false );
+				if( entry != nullptr )
+				{
+					sum.allocs += entry->allocs;
+					sum.frees += entry->frees;
+					sum.live += entry->live;
+				}
+			}
+
+			/* insertion into stats[], sorted by live bytes */
+			unsigned pos = count;
+			while( pos > 0 && stats[pos - 1].live < sum.live )
+			{
+				if( pos < top )
+				{
+					stats[pos] = stats[pos - 1];
+				}
+				--pos;
+			}
+			if( pos < top )
+			{
+				stats[pos] = sum;
+				if( count < top )
+				{
+					++count;
+				}
+			}
+		}
+	}
+	return count;
+}
+
+void
+dump( unsigned top )
+{
+	struct site_stats stats[KMALLOC_PROFILE_DUMP_MAX];
+
+	if( top > KMALLOC_PROFILE_DUMP_MAX )
+	{
+		top = KMALLOC_PROFILE_DUMP_MAX;
+	}
+
+	unsigned count = collect( top, stats );
+	log::printk( "kmalloc-profile: top %u call sites by live bytes, %lu dropped\n",
+	             count, __atomic_load_n( &_profile_dropped, __ATOMIC_RELAXED ) );
+	for( unsigned i = 0; i < count; ++i )
+	{
+		log::printk( "kmalloc-profile: %#018lx live %ld allocs %lu frees %lu\n",
+		             stats[i].site, stats[i].live, stats[i].allocs, stats[i].frees );
+	}
+}
+
+void
+init_cpu( void )
+{
+	_profile_cores_enabled = true;
+}
+
+void
+init( void )
+{
+	auto objects = ( struct live_object* )::vmalloc( KMALLOC_PROFILE_OBJECTS *
+	                                               sizeof( struct live_object ) );
+	auto sites   = ( struct site_stats* )::vmalloc( KMALLOC_PROFILE_CORES * KMALLOC_PROFILE_SITES *
+	                                              sizeof( struct site_stats ) );
+	if( objects == nullptr || sites == nullptr )
+	{
+		log::printk( "kmalloc-profile: failed to allocate the profile tables!\n" );
+		if( objects != nullptr )
+		{
+			::vfree( objects );
+		}
+		if( sites != nullptr )
+		{
+			::vfree( sites );
+		}
+		return;
+	}
+
+	memset( objects, 0, KMALLOC_PROFILE_OBJECTS * sizeof( struct live_object ) );
+	memset( sites, 0, KMALLOC_PROFILE_CORES * KMALLOC_PROFILE_SITES *
+	                  sizeof( struct site_stats ) );
+
+	for( unsigned i = 0; i < KMALLOC_PROFILE_SHARDS; ++i )
+	{
+		_profile_shards[i].count   = 0;
+		_profile_shards[i].objects = &objects[i * KMALLOC_PROFILE_SHARD_OBJECTS];
+	}
+	__atomic_store_n( &_profile_sites, sites, __ATOMIC_RELEASE );
+}
+
+};
+};
+
+#endif
@@ -21,11 +21,11 @@
 
 /* IO-Memory resource management */
 
-#include <new>
 #include <list.h>
 #include <hotarubi/lock.h>
 
 #include <hotarubi/memory/mmio.h>
+#include <hotarubi/memory/object_cache.h>
 
 #include <hotarubi/memory/virtmm.h>
 #include <hotarubi/memory/const.h>
@@ -52,6 +52,7 @@ struct resource
 };
 
 static spin_lock _mmio_resource_lock;
+static object_cache<resource> _mmio_resource_cache;
 static resource _mmio_mem_root { "IO mem", 0, 0xffffffff, Flags::kIOMem, 1, nullptr, { nullptr, nullptr }, { nullptr, nullptr } };
 static resource _mmio_port_root { "IO ports", 0, 0xffff, Flags::kIOPort, 1, nullptr, { nullptr, nullptr }, { nullptr, nullptr } };
 
@@ -211,7 +212,11 @@ request_region( const char *name, phys_addr_t start, size_t size, Flags flags )
 	}
 	if( request == nullptr )
 	{
-		request = new( std::nothrow ) struct resource;
+		request = _mmio_resource_cache.create();
+		if( request == nullptr )
+		{
+			return nullptr;
+		}
 
 		request->name  = name;
 		request->start = start;
@@ -229,7 +234,7 @@ request_region( const char *name, phys_addr_t start, size_t size, Flags flags )
 		_mmio_resource_lock.lock();
 		if( _request_resource( root, request ) != request )
 		{
-			delete request;
+			_mmio_resource_cache.destroy( request );
 			request = nullptr;
 		}
 		_mmio_resource_lock.unlock();
@@ -244,7 +249,7 @@ release_region( resource_t *region )
 	_release_resource( *region );
 	if( ( *region )->refcount == 0 )
 	{
-		delete *region;
+		_mmio_resource_cache.destroy( *region );
 		*region = nullptr;
 	}
 	_mmio_resource_lock.unlock();
@@ -291,6 +296,11 @@ init( void )
 {
 	INIT_LIST( _mmio_mem_root.children );
 	INIT_LIST( _mmio_port_root.children );
+
+	if( _mmio_resource_cache.get() == nullptr )
+	{
+		_mmio_resource_cache.init( "mmio::resource" );
+	}
 }
 
 };
@@ -26,12 +26,18 @@
 #include <hotarubi/memory/page.h>
 
 #include <hotarubi/lock.h>
+#include <hotarubi/macros.h>
 #include <hotarubi/log/log.h>
+#include <hotarubi/processor/core.h>
+#include <hotarubi/processor/regs.h>
 
 #ifdef KERNEL
 extern "C" unsigned char __end[]; /* defined in link.ld */
 #endif
 
+LOCAL_DATA_INC( hotarubi/memory/physmm.h );
+LOCAL_DATA_DEF( struct memory::physmm::page_cache page_cache );
+
 /* convert x to a physical address with regard for physical_base_offset */
 #define __XPA( x )( ( ( x ) >= physical_base_offset() ) ? __PA( x ) : ( x ) )
 
@@ -41,407 +47,2243 @@ namespace physmm
 {
 
 phys_addr_t        memory_upper_bound = 0;
-page_map_t        *memory_map_pages   = nullptr;
 
-static uint32_t   *_memory_map_data   = nullptr;
-static uint32_t    _memory_map_size   = 0;
-static uint32_t    _memory_map_used   = 0;
-static phys_addr_t _memory_map_base   = 0; /* offset applied to physical addresses */
-static spin_lock   _memory_map_lock;
+/* the bitmap is scanned one 64bit word at a time, _memory_map_summary holds
+ * one bit per bitmap word which is set if that word is completely used.
+ */
+static uint64_t   *_memory_map_data    = nullptr;
+static uint64_t   *_memory_map_summary = nullptr;
+static uint32_t    _memory_map_size    = 0; /* in bytes */
+static phys_addr_t _memory_map_base    = 0; /* offset applied to physical addresses */
+
+/* memory zones
+ * Each zone is a contiguous range of memory of one type ( DMA, DMA32, Normal )
+ * on one NUMA node, the zones are sorted by address. Zone boundaries are
+ * multiples of 16MB, so every bitmap word, every summary word and every buddy
+ * block belongs to exactly one zone. The bitmap and the page map are shared,
+ * the state below is kept per zone and protected by the zone lock.
+ * All bitmap words between start and hint are completely used.
+ *
+ * buddy allocator state
+ * The bitmap stays the authoritative record of used pages. In addition every
+ * free page is part of exactly one naturally aligned block of 2^order pages
+ * which is linked into free_area[order] using the page_map_t of its first page.
+ */
+#define ZONE_DMA    0
+#define ZONE_DMA32  1
+#define ZONE_NORMAL 2
+#define ZONE_COUNT  3
+
+#define ZONE_CHUNK_PAGES 4096 /* 16MB */
+#define ZONE_MAX         ( ZONE_COUNT * PHYSMM_MAX_NODES + 8 )
+#define ZONE_LIST_END    0xff
+
+struct zone
+{
+	const char *name;
+	uint8_t type;
+	uint8_t node;
+	uint64_t start; /* first page frame */
+	uint64_t end;   /* first page frame above the zone */
+	uint64_t used;
+	uint64_t hint;  /* bitmap word */
+	struct list_head free_area[PHYSMM_MAX_ORDER + 1];
+	uint64_t free_area_count[PHYSMM_MAX_ORDER + 1];
+	spin_lock lock;
+	uint64_t lock_since; /* TSC when the lock was taken */
+
+	/* telemetry, see get_zone_stats() */
+	struct
+	{
+		uint64_t alloc[PHYSMM_MAX_ORDER + 1];
+		uint64_t free[PHYSMM_MAX_ORDER + 1];
+		uint64_t failed;
+		uint64_t locks;
+		uint64_t lock_wait;
+		uint64_t lock_hold;
+	} stats;
+};
 
-static inline bool
-_peek_used( uint64_t bit )
+static const struct
+{
+	const char *name;
+	phys_addr_t end;
+} _zone_layout[ZONE_COUNT] = {
+	{ "DMA"   , 0x1000000ULL   }, /* ISA DMA */
+	{ "DMA32" , 0x100000000ULL }, /* 32bit devices */
+	{ "Normal", ~0ULL          },
+};
+
+static struct zone _zones[ZONE_MAX];
+static unsigned    _zone_count   = 0;
+static uint64_t    _buddy_pages  = 0; /* number of pages covered */
+
+/* NUMA layout as reported by the firmware, without it everything is node 0
+ * _zone_lists holds the allocation order for each local node and highest
+ * zone type: nodes by distance, DMA zones only after everything else.
+ */
+static struct node_range _node_ranges[PHYSMM_MAX_RANGES];
+static unsigned          _node_range_count = 0;
+static unsigned          _node_count       = 1;
+static uint8_t           _node_distance[PHYSMM_MAX_NODES][PHYSMM_MAX_NODES];
+static uint8_t           _zone_lists[PHYSMM_MAX_NODES][ZONE_COUNT][ZONE_MAX + 1];
+static bool        _buddy_active = false;
+
+/* deferred page metadata
+ * The page_map_t entries of a 16MB chunk are only initialized the first time
+ * the chunk is allocated from, freed to or looked up ( or by init_deferred ).
+ * Until then its free pages are tracked by the bitmap but not by the buddy
+ * free lists. A chunk belongs to exactly one zone, it is brought online with
+ * that zone locked. nullptr means every chunk is online.
+ */
+static uint8_t *_chunk_online = nullptr;
+
+/* sparse page metadata
+ * The page map is split into sections of 128MB and only sections containing
+ * usable RAM get a page_map_t array, preferably placed inside the section
+ * itself. Every entry records its section so the page frame number can be
+ * recovered from an entry without searching.
+ */
+#define SECTION_SHIFT 15
+#define SECTION_PAGES ( 1ULL << SECTION_SHIFT ) /* 128MB */
+
+static page_map_t **_section_map   = nullptr;
+static uint64_t     _section_count = 0;
+
+/* request flags that select a zone, never stored in the page map */
+static constexpr Flags _zone_flags = __PPF( ZoneDMA ) | __PPF( ZoneDMA32 ) | __PPF( ZoneNormal );
+static constexpr Flags _request_flags = _zone_flags | __PPF( Zeroed );
+
+/* per-CPU page caches
+ * Single pages are handed out from and returned to a small cache in the local
+ * data of each core. Pages in a cache are marked used in the bitmap, the
+ * global lock is only taken to refill or drain a whole batch.
+ */
+static bool _page_cache_enabled = false;
+#ifndef KERNEL
+static struct page_cache _host_page_cache; /* stands in for %gs in tests */
+static unsigned          _host_node = 0;
+#endif
+
+/* pre-zeroed pages
+ * zero_idle_pages() clears free pages using non-temporal stores ( so they do
+ * not push anything useful out of the caches ) and parks them here. Pooled
+ * pages are marked used in the bitmap. Single page kZeroed requests take
+ * from the pool and only clear a page themselves if it ran empty.
+ */
+static phys_addr_t            _zero_pool[PHYSMM_ZERO_POOL_SIZE];
+static unsigned               _zero_pool_count = 0;
+static spin_lock              _zero_pool_lock;
+static struct zero_pool_stats _zero_pool_stats;
+
+/* memory pressure
+ * Once fewer than PHYSMM_RECLAIM_WATERMARK pages are free, or an allocation
+ * can't be served at all, the reclaim callback ( cache::reclaim ) is asked
+ * to give pages back. Only one core reclaims at a time, the others carry on
+ * with whatever is left.
+ */
+static reclaim_callback _reclaim_callback = nullptr;
+static bool             _reclaim_active   = false;
+
+#define MAP_WORD_BITS 64
+#define MAP_WORD_FULL 0xffffffffffffffffULL
+
+static inline uint64_t
+_map_words( void )
+{
+	return _memory_map_size / sizeof( _memory_map_data[0] );
+}
+
+static inline uint64_t
+_map_summary_words( void )
+{
+	return ( _map_words() + MAP_WORD_BITS - 1 ) / MAP_WORD_BITS;
+}
+
+static inline page_map_t*
+_page_map( uint64_t pfn )
+{
+	return _section_map[pfn >> SECTION_SHIFT] + ( pfn & ( SECTION_PAGES - 1 ) );
+}
+
+static inline uint64_t
+_page_map_pfn( const page_map_t *map )
+{
+	return ( ( uint64_t )map->section << SECTION_SHIFT ) + ( map - _section_map[map->section] );
+}
+
+/* clear the entry of pfn keeping its section */
+static inline void
+_page_map_reset( uint64_t pfn, Flags flags )
 {
-	if( bit > _memory_map_size * 8 )
+	auto map = _page_map( pfn );
+
+	memset( map, 0, sizeof( page_map_t ) );
+	map->flags   = flags;
+	map->section = pfn >> SECTION_SHIFT;
+}
+
+static inline struct zone*
+_zone_of( uint64_t pfn )
+{
+	unsigned i = _zone_count - 1;
+
+	while( i > 0 && pfn < _zones[i].start )
 	{
-		return true;
+		--i;
 	}
-	return _memory_map_data[ bit / 32 ] & ( 1 << ( bit % 32 ) );
+	return &_zones[i];
 }
 
+/* zone locks are timed, the caller is about to spin on a contended lock
+ * anyway and the hold time is what keeps other cores waiting */
 static inline void
-_mark_used( uint64_t bit )
+_zone_lock( struct zone *z )
+{
+	uint64_t start = processor::regs::read_tsc();
+
+	z->lock.lock();
+	z->lock_since = processor::regs::read_tsc();
+	z->stats.lock_wait += z->lock_since - start;
+	++z->stats.locks;
+}
+
+static inline void
+_zone_unlock( struct zone *z )
 {
-	if( ( bit < _memory_map_size * 8 ) && _peek_used( bit ) == false )
+	z->stats.lock_hold += processor::regs::read_tsc() - z->lock_since;
+	z->lock.unlock();
+}
+
+/* scoped_lock for zones */
+class zone_lock
+{
+public:
+	zone_lock( struct zone *z ) : _zone{z}
+	{
+		_zone_lock( _zone );
+	};
+
+	~zone_lock()
 	{
-		_memory_map_data[ bit / 32 ] |= ( 1 << ( bit % 32 ) );
-		++_memory_map_used;
+		_zone_unlock( _zone );
 	}
+private:
+	struct zone *_zone;
+};
+
+/* allocation and free counters by order, larger ranges count as the
+ * largest order, these are updated without holding the zone lock */
+static inline unsigned
+_stat_order( uint64_t count )
+{
+	unsigned order = ( count > 1 ) ? 64 - __builtin_clzll( count - 1 ) : 0;
+
+	return ( order < PHYSMM_MAX_ORDER ) ? order : PHYSMM_MAX_ORDER;
 }
 
 static inline void
-_mark_free( uint64_t bit )
+_stat_alloc( uint64_t pfn, uint64_t count )
+{
+	__atomic_fetch_add( &_zone_of( pfn )->stats.alloc[_stat_order( count )], 1, __ATOMIC_RELAXED );
+}
+
+static inline void
+_stat_free( uint64_t pfn, uint64_t count )
+{
+	__atomic_fetch_add( &_zone_of( pfn )->stats.free[_stat_order( count )], 1, __ATOMIC_RELAXED );
+}
+
+/* failures are accounted to the preferred zone of the request */
+static inline void
+_stat_failed( const uint8_t *list )
 {
-	if( ( bit < _memory_map_size * 8 ) && _peek_used( bit ) == true )
+	if( *list != ZONE_LIST_END )
 	{
-		_memory_map_data[ bit / 32 ] &= ~( 1 << ( bit % 32 ) );
-		--_memory_map_used;
+		__atomic_fetch_add( &_zones[*list].stats.failed, 1, __ATOMIC_RELAXED );
 	}
 }
 
-static inline void
-_mark_free_range( phys_addr_t addr, size_t len )
+/* the highest zone type a request may be served from */
+static inline unsigned
+_zone_highest( Flags flags )
+{
+	if( flag_set( flags, __PPF( ZoneDMA ) ) )
+	{
+		return ZONE_DMA;
+	}
+	if( flag_set( flags, __PPF( ZoneDMA32 ) ) )
+	{
+		return ZONE_DMA32;
+	}
+	return ZONE_NORMAL;
+}
+
+static inline uint64_t
+_zone_free( const struct zone *z )
+{
+	return ( z->end - z->start ) - z->used;
+}
+
+/* first page frame above the searchable part of a zone */
+static inline uint64_t
+_zone_limit( const struct zone *z )
 {
-	uint64_t bit = addr / PAGE_SIZE;
-	len = len / PAGE_SIZE;
+	uint64_t end = z->end;
 
-	for( ; len > 0; --len )
+#ifdef KERNEL
+	/* until the physical memory map exists only the boot mapping is usable */
+	if( _memory_map_base == 0 && end > BOOT_MAX_MAPPED / PAGE_SIZE )
 	{
-		_mark_free( bit++ );
+		end = BOOT_MAX_MAPPED / PAGE_SIZE;
 	}
+#endif
+	return end;
 }
 
 static inline void
-_mark_used_range( phys_addr_t addr, size_t len )
+_summary_update( uint64_t word )
 {
-	uint64_t bit = addr / PAGE_SIZE;
-	len = len / PAGE_SIZE;
+	if( _memory_map_summary == nullptr )
+	{
+		return;
+	}
 
-	for( ; len > 0; --len )
+	if( _memory_map_data[word] == MAP_WORD_FULL )
 	{
-		_mark_used( bit++ );
+		_memory_map_summary[word / MAP_WORD_BITS] |= ( 1ULL << ( word % MAP_WORD_BITS ) );
+	}
+	else
+	{
+		_memory_map_summary[word / MAP_WORD_BITS] &= ~( 1ULL << ( word % MAP_WORD_BITS ) );
 	}
 }
 
-static inline phys_addr_t
-_search_first_free( void )
+/* node a page frame belongs to, holes inherit the node of the memory below */
+static unsigned
+_node_of( uint64_t pfn, unsigned fallback )
+{
+	for( unsigned i = 0; i < _node_range_count; ++i )
+	{
+		auto r = &_node_ranges[i];
+		if( pfn >= r->base / PAGE_SIZE && pfn < ( r->base + r->length ) / PAGE_SIZE )
+		{
+			return r->node;
+		}
+	}
+	return fallback;
+}
+
+static void
+_zone_lists_setup( void )
 {
-	for( size_t i = 0; i < _memory_map_size / sizeof( _memory_map_data[0] ); ++i )
+	for( unsigned local = 0; local < _node_count; ++local )
 	{
-		if( _memory_map_data[i] != 0xffffffff )
+		uint8_t order[PHYSMM_MAX_NODES];
+
+		/* nodes sorted by distance, ties by id - so local comes first */
+		for( unsigned i = 0; i < _node_count; ++i )
+		{
+			unsigned j = i;
+
+			for( ; j > 0 && _node_distance[local][order[j - 1]] > _node_distance[local][i]; --j )
+			{
+				order[j] = order[j - 1];
+			}
+			order[j] = i;
+		}
+
+		for( unsigned highest = ZONE_DMA; highest < ZONE_COUNT; ++highest )
 		{
-			for( uint64_t bit = 0; bit < 32; ++bit )
+			auto list = _zone_lists[local][highest];
+			unsigned n = 0;
+
+			for( unsigned i = 0; i < _node_count; ++i )
+			{
+				for( int type = highest; type > ZONE_DMA; --type )
+				{
+					for( unsigned z = 0; z < _zone_count; ++z )
+					{
+						if( _zones[z].node == order[i] && _zones[z].type == type )
+						{
+							list[n++] = z;
+						}
+					}
+				}
+			}
+			for( unsigned i = 0; i < _node_count; ++i )
 			{
-				if( _peek_used( i * 32 + bit ) == false )
+				for( unsigned z = 0; z < _zone_count; ++z )
 				{
-					return ( i * 32 + bit ) * PAGE_SIZE;
+					if( _zones[z].node == order[i] && _zones[z].type == ZONE_DMA )
+					{
+						list[n++] = z;
+					}
 				}
 			}
+			list[n] = ZONE_LIST_END;
 		}
 	}
-	return 0;
+}
+
+/* recalculate zones, usage, hints and the summary after the bitmap or the
+ * NUMA layout was modified directly */
+static void
+_zone_setup( void )
+{
+	uint64_t pages = _memory_map_size * 8ULL;
+	unsigned node  = 0;
+
+	_zone_count = 0;
+	for( uint64_t chunk = 0; chunk < pages; chunk += ZONE_CHUNK_PAGES )
+	{
+		unsigned type = ZONE_DMA;
+		while( chunk >= _zone_layout[type].end / PAGE_SIZE )
+		{
+			++type;
+		}
+		node = _node_of( chunk, node );
+
+		/* out of zones: further node boundaries are ignored */
+		if( _zone_count == 0 || _zones[_zone_count - 1].type != type ||
+		    ( _zones[_zone_count - 1].node != node && _zone_count < ZONE_MAX - ZONE_COUNT ) )
+		{
+			auto z   = &_zones[_zone_count++];
+			z->name  = _zone_layout[type].name;
+			z->type  = type;
+			z->node  = node;
+			z->start = chunk;
+			z->hint  = chunk / MAP_WORD_BITS;
+			z->used  = 0;
+			memset( &z->stats, 0, sizeof( z->stats ) );
+		}
+
+		auto z = &_zones[_zone_count - 1];
+		z->end = ( chunk + ZONE_CHUNK_PAGES < pages ) ? chunk + ZONE_CHUNK_PAGES : pages;
+
+		for( uint64_t word = chunk / MAP_WORD_BITS; word < z->end / MAP_WORD_BITS; ++word )
+		{
+			z->used += __builtin_popcountll( _memory_map_data[word] );
+		}
+	}
+	_zone_lists_setup();
+
+	if( _memory_map_summary != nullptr )
+	{
+		for( uint64_t i = 0; i < _map_summary_words(); ++i )
+		{
+			_memory_map_summary[i] = 0;
+		}
+		for( uint64_t i = 0; i < _map_words(); ++i )
+		{
+			_summary_update( i );
+		}
+	}
+}
+
+static inline unsigned
+_local_node( void )
+{
+	unsigned node = 0;
+
+#ifdef KERNEL
+	/* %gs is valid once the page caches are set up */
+	if( _page_cache_enabled )
+	{
+		node = processor::core::current()->node;
+	}
+#else
+	node = _host_node;
+#endif
+	return ( node < _node_count ) ? node : 0;
+}
+
+/* index of the first word in [word, limit) that has at least one free bit
+ * or limit if there is none */
+static inline uint64_t
+_next_nonfull_word( uint64_t word, uint64_t limit )
+{
+	if( _memory_map_summary == nullptr )
+	{
+		while( word < limit && _memory_map_data[word] == MAP_WORD_FULL )
+		{
+			++word;
+		}
+		return ( word < limit ) ? word : limit;
+	}
+
+	while( word < limit )
+	{
+		uint64_t pending = ~_memory_map_summary[word / MAP_WORD_BITS] &
+		                   ( MAP_WORD_FULL << ( word % MAP_WORD_BITS ) );
+		if( pending != 0 )
+		{
+			word = ( word & ~( uint64_t )( MAP_WORD_BITS - 1 ) ) + __builtin_ctzll( pending );
+			return ( word < limit ) ? word : limit;
+		}
+		/* 64 completely used words ( 4096 pages ) skipped at once */
+		word = ( word & ~( uint64_t )( MAP_WORD_BITS - 1 ) ) + MAP_WORD_BITS;
+	}
+	return limit;
+}
+
+/* index of the first free bit in [bit, limit) or limit */
+static inline uint64_t
+_find_next_free( uint64_t bit, uint64_t limit )
+{
+	while( bit < limit )
+	{
+		uint64_t word = bit / MAP_WORD_BITS;
+		uint64_t free = ~_memory_map_data[word] & ( MAP_WORD_FULL << ( bit % MAP_WORD_BITS ) );
+
+		if( free != 0 )
+		{
+			bit = word * MAP_WORD_BITS + __builtin_ctzll( free );
+			break;
+		}
+		bit = _next_nonfull_word( word + 1, ( limit + MAP_WORD_BITS - 1 ) / MAP_WORD_BITS ) * MAP_WORD_BITS;
+	}
+	return ( bit < limit ) ? bit : limit;
+}
+
+/* index of the first used bit in [bit, limit) or limit */
+static inline uint64_t
+_find_next_used( uint64_t bit, uint64_t limit )
+{
+	while( bit < limit )
+	{
+		uint64_t word = bit / MAP_WORD_BITS;
+		uint64_t used = _memory_map_data[word] & ( MAP_WORD_FULL << ( bit % MAP_WORD_BITS ) );
+
+		if( used != 0 )
+		{
+			bit = word * MAP_WORD_BITS + __builtin_ctzll( used );
+			break;
+		}
+		bit = ( word + 1 ) * MAP_WORD_BITS;
+	}
+	return ( bit < limit ) ? bit : limit;
+}
+
+static inline bool
+_peek_used( uint64_t bit )
+{
+	if( bit >= _memory_map_size * 8ULL )
+	{
+		return true;
+	}
+	return _memory_map_data[ bit / MAP_WORD_BITS ] & ( 1ULL << ( bit % MAP_WORD_BITS ) );
+}
+
+/* mark the bits [bit, bit + count) as used one word at a time */
+static inline void
+_mark_used_bits( uint64_t bit, uint64_t count )
+{
+	uint64_t end = bit + count;
+
+	if( end > _memory_map_size * 8ULL )
+	{
+		end = _memory_map_size * 8ULL;
+	}
+
+	while( bit < end )
+	{
+		uint64_t word  = bit / MAP_WORD_BITS;
+		uint64_t shift = bit % MAP_WORD_BITS;
+		uint64_t span  = ( end - bit < MAP_WORD_BITS - shift ) ? end - bit : MAP_WORD_BITS - shift;
+		uint64_t mask  = ( span == MAP_WORD_BITS ) ? MAP_WORD_FULL : ( ( 1ULL << span ) - 1 ) << shift;
+
+		_zone_of( word * MAP_WORD_BITS )->used += __builtin_popcountll( mask & ~_memory_map_data[word] );
+		_memory_map_data[word] |= mask;
+		_summary_update( word );
+
+		bit += span;
+	}
+}
+
+/* mark the bits [bit, bit + count) as free one word at a time */
+static inline void
+_mark_free_bits( uint64_t bit, uint64_t count )
+{
+	uint64_t end = bit + count;
+
+	if( end > _memory_map_size * 8ULL )
+	{
+		end = _memory_map_size * 8ULL;
+	}
+
+	while( bit < end )
+	{
+		uint64_t word  = bit / MAP_WORD_BITS;
+		uint64_t shift = bit % MAP_WORD_BITS;
+		uint64_t span  = ( end - bit < MAP_WORD_BITS - shift ) ? end - bit : MAP_WORD_BITS - shift;
+		uint64_t mask  = ( span == MAP_WORD_BITS ) ? MAP_WORD_FULL : ( ( 1ULL << span ) - 1 ) << shift;
+		auto zone      = _zone_of( word * MAP_WORD_BITS );
+
+		if( word < zone->hint )
+		{
+			zone->hint = word;
+		}
+		zone->used -= __builtin_popcountll( mask & _memory_map_data[word] );
+		_memory_map_data[word] &= ~mask;
+		_summary_update( word );
+
+		bit += span;
+	}
+}
+
+static inline void
+_mark_used( uint64_t bit )
+{
+	_mark_used_bits( bit, 1 );
+}
+
+static inline void
+_mark_free( uint64_t bit )
+{
+	_mark_free_bits( bit, 1 );
+}
+
+static inline void
+_mark_free_range( phys_addr_t addr, size_t len )
+{
+	_mark_free_bits( addr / PAGE_SIZE, len / PAGE_SIZE );
+}
+
+static inline void
+_mark_used_range( phys_addr_t addr, size_t len )
+{
+	_mark_used_bits( addr / PAGE_SIZE, len / PAGE_SIZE );
+}
+
+static inline phys_addr_t
+_search_first_free( struct zone *z )
+{
+	uint64_t limit = _zone_limit( z ) / MAP_WORD_BITS;
+	uint64_t word  = _next_nonfull_word( z->hint, limit );
+
+	/* everything below word is used - remember that for the next search */
+	if( word > z->hint )
+	{
+		z->hint = word;
+	}
+	if( word >= limit )
+	{
+		return 0;
+	}
+	return ( word * MAP_WORD_BITS + __builtin_ctzll( ~_memory_map_data[word] ) ) * PAGE_SIZE;
+}
+
+/* bits set in the result mark the start of a run of num free bits in word */
+static inline uint64_t
+_word_free_runs( uint64_t word, unsigned num )
+{
+	uint64_t runs = ~word;
+	unsigned len  = 1;
+
+	while( runs != 0 && len * 2 <= num )
+	{
+		runs &= runs >> len;
+		len  *= 2;
+	}
+	if( len < num )
+	{
+		runs &= runs >> ( num - len );
+	}
+	return runs;
 }
 
 static inline phys_addr_t
-_search_first_free_range( unsigned num )
+_search_first_free_range( struct zone *z, unsigned num )
 {
+	uint64_t limit = _zone_limit( z ) / MAP_WORD_BITS;
+	uint64_t carry = 0; /* free bits at the top of the previous word */
+
 	if( num <= 1 )
 	{
-		return ( num == 0 ) ? 0 : _search_first_free();
+		return ( num == 0 ) ? 0 : _search_first_free( z );
 	}
 
-	/* TODO: faster version using masks! */
-	for( size_t i = 0; i < _memory_map_size / sizeof( _memory_map_data[0] ); ++i )
+	for( uint64_t word = _next_nonfull_word( z->hint, limit ); word < limit; )
 	{
-		if( _memory_map_data[i] != 0xffffffff )
+		uint64_t data = _memory_map_data[word];
+
+		/* runs starting in the previous word(s) */
+		if( carry > 0 )
 		{
-			for( uint64_t bit = 0; bit < 32; ++bit )
+			uint64_t lead = ( data == 0 ) ? MAP_WORD_BITS : __builtin_ctzll( data );
+			if( carry + lead >= num )
 			{
-				if( _peek_used( i * 32 + bit ) == false )
-				{
-					bool match = true;
-					for( size_t n = 1; n < num; ++n )
-					{
-						if( _peek_used( i * 32 + ( bit + n ) ) == true )
-						{
-							match = false;
-							break;
-						}
-					}
+				return ( word * MAP_WORD_BITS - carry ) * PAGE_SIZE;
+			}
+		}
 
-					if( match )
-					{
-						return ( i * 32 + bit ) * PAGE_SIZE;
-					}
-				}
+		/* runs inside of this word */
+		if( num <= MAP_WORD_BITS )
+		{
+			uint64_t runs = _word_free_runs( data, num );
+			if( runs != 0 )
+			{
+				return ( word * MAP_WORD_BITS + __builtin_ctzll( runs ) ) * PAGE_SIZE;
 			}
 		}
+
+		if( data == 0 )
+		{
+			carry += MAP_WORD_BITS;
+			++word;
+		}
+		else if( data == MAP_WORD_FULL )
+		{
+			carry = 0;
+			word  = _next_nonfull_word( word + 1, limit );
+		}
+		else
+		{
+			carry = __builtin_clzll( data );
+			++word;
+		}
 	}
 	return 0;
 }
 
-static void
-_flag_page_range( phys_addr_t addr, Flags flags, size_t len )
+static void
+_flag_page_range( phys_addr_t addr, Flags flags, size_t len )
+{
+#ifdef KERNEL
+
+	for( len /= PAGE_SIZE; len > 0 && ( __XPA( addr ) >> PAGE_SHIFT ) < _memory_map_size * 8; --len )
+	{
+		INIT_LIST( _page_map( __XPA( addr ) >> PAGE_SHIFT )->link );
+		_page_map( __XPA( addr ) >> PAGE_SHIFT )->flags = flags;
+
+		addr += PAGE_SIZE;
+	}
+
+#endif
+}
+
+static void
+_free_page_range( phys_addr_t addr, size_t len )
+{
+#ifdef KERNEL
+
+	for( len /= PAGE_SIZE; len > 0 && ( __XPA( addr ) >> PAGE_SHIFT ) < _memory_map_size * 8; --len )
+	{
+		_page_map_reset( __XPA( addr ) >> PAGE_SHIFT, __PPF( Unused ) );
+
+		addr += PAGE_SIZE;
+	}
+
+#endif
+}
+
+static inline bool
+_buddy_is_head( uint64_t pfn, unsigned order )
+{
+	return ( pfn < _buddy_pages ) &&
+	       flag_set( _page_map( pfn )->flags, __PPF( Buddy ) ) &&
+	       _page_map( pfn )->order == order;
+}
+
+static inline void
+_buddy_link( uint64_t pfn, unsigned order )
+{
+	auto map = _page_map( pfn );
+
+	auto zone = _zone_of( pfn );
+
+	map->flags = __PPF( Unused ) | __PPF( Buddy );
+	map->order = order;
+	list_add( &zone->free_area[order], &map->link );
+	++zone->free_area_count[order];
+}
+
+static inline void
+_buddy_unlink( uint64_t pfn )
+{
+	auto map = _page_map( pfn );
+
+	list_del( &map->link );
+	--_zone_of( pfn )->free_area_count[map->order];
+	map->flags = __PPF( Unused );
+	map->order = 0;
+}
+
+static inline unsigned
+_buddy_order( uint64_t count )
+{
+	unsigned order = 0;
+	while( ( 1ULL << order ) < count )
+	{
+		++order;
+	}
+	return order;
+}
+
+/* return a single free block to the free lists merging it with its buddies */
+static void
+_buddy_free_block( uint64_t pfn, unsigned order )
+{
+	while( order < PHYSMM_MAX_ORDER )
+	{
+		uint64_t buddy = pfn ^ ( 1ULL << order );
+		if( !_buddy_is_head( buddy, order ) )
+		{
+			break;
+		}
+		_buddy_unlink( buddy );
+		pfn &= ~( 1ULL << order );
+		++order;
+	}
+	_buddy_link( pfn, order );
+}
+
+/* return an arbitrary run of free pages as a set of naturally aligned blocks */
+static void
+_buddy_free_range( uint64_t pfn, uint64_t count )
+{
+	while( count > 0 )
+	{
+		unsigned order = 0;
+		while( order < PHYSMM_MAX_ORDER &&
+		       ( pfn & ( ( 2ULL << order ) - 1 ) ) == 0 &&
+		       ( 2ULL << order ) <= count )
+		{
+			++order;
+		}
+		_buddy_free_block( pfn, order );
+
+		pfn   += 1ULL << order;
+		count -= 1ULL << order;
+	}
+}
+
+/* locate the free block containing pfn */
+static bool
+_buddy_find_block( uint64_t pfn, uint64_t &head, unsigned &order )
+{
+	for( unsigned o = 0; o <= PHYSMM_MAX_ORDER; ++o )
+	{
+		uint64_t candidate = pfn & ~( ( 1ULL << o ) - 1 );
+		if( _buddy_is_head( candidate, o ) )
+		{
+			head  = candidate;
+			order = o;
+			return true;
+		}
+	}
+	return false;
+}
+
+/* remove the free pages [pfn, pfn + count) from the free lists splitting
+ * the blocks they are part of as needed */
+static void
+_buddy_carve( uint64_t pfn, uint64_t count )
+{
+	while( count > 0 )
+	{
+		uint64_t head, end, stop;
+		unsigned order;
+
+		if( !_buddy_find_block( pfn, head, order ) )
+		{
+			++pfn;
+			--count;
+			continue;
+		}
+		_buddy_unlink( head );
+
+		end  = head + ( 1ULL << order );
+		stop = ( pfn + count < end ) ? pfn + count : end;
+
+		if( head < pfn )
+		{
+			_buddy_free_range( head, pfn - head );
+		}
+		if( stop < end )
+		{
+			_buddy_free_range( stop, end - stop );
+		}
+		count -= stop - pfn;
+		pfn    = stop;
+	}
+}
+
+/* take a block of at least 2^order pages from the free lists */
+static bool
+_buddy_alloc( struct zone *z, unsigned order, uint64_t &pfn )
+{
+	for( unsigned o = order; o <= PHYSMM_MAX_ORDER; ++o )
+	{
+		if( !list_empty( &z->free_area[o] ) )
+		{
+			auto map = LIST_HEAD_ENTRY( &z->free_area[o], page_map_t, link );
+
+			pfn = _page_map_pfn( map );
+			_buddy_unlink( pfn );
+
+			/* split the block handing back the upper halves */
+			while( o > order )
+			{
+				--o;
+				_buddy_link( pfn + ( 1ULL << o ), o );
+			}
+			return true;
+		}
+	}
+	return false;
+}
+
+/* hand all free pages in [pfn, limit) to the buddy allocator */
+static void
+_buddy_add_free( uint64_t pfn, uint64_t limit )
+{
+	/* page 0 is never handed out */
+	pfn = ( pfn > 0 ) ? pfn : 1;
+
+	while( ( pfn = _find_next_free( pfn, limit ) ) < limit )
+	{
+		uint64_t end = _find_next_used( pfn, limit );
+
+		_buddy_free_range( pfn, end - pfn );
+		pfn = end;
+	}
+}
+
+static inline bool
+_chunk_is_online( uint64_t chunk )
+{
+	return ( _chunk_online == nullptr ) ||
+	       __atomic_load_n( &_chunk_online[chunk], __ATOMIC_ACQUIRE );
+}
+
+/* initialize the page metadata of a chunk, used pages are reserved until
+ * they are freed - the caller has to hold the lock of the chunk's zone */
+static void
+_chunk_init( uint64_t chunk )
+{
+	uint64_t start = chunk * ZONE_CHUNK_PAGES;
+	uint64_t end   = start + ZONE_CHUNK_PAGES;
+
+	if( end > _memory_map_size * 8ULL )
+	{
+		end = _memory_map_size * 8ULL;
+	}
+
+	/* chunks without RAM have neither metadata nor free pages */
+	for( uint64_t pfn = start; pfn < end && _section_map[pfn >> SECTION_SHIFT]; ++pfn )
+	{
+		_page_map_reset( pfn, _peek_used( pfn ) ? __PPF( Reserved ) : __PPF( Unused ) );
+	}
+	if( _buddy_active )
+	{
+		_buddy_add_free( start, end );
+	}
+	__atomic_store_n( &_chunk_online[chunk], 1, __ATOMIC_RELEASE );
+}
+
+/* make sure the metadata of [pfn, pfn + count) is valid
+ * the caller has to hold the lock of the zone containing the range */
+static inline void
+_chunk_online_range( uint64_t pfn, uint64_t count )
+{
+	for( uint64_t chunk = pfn / ZONE_CHUNK_PAGES;
+	     chunk <= ( pfn + count - 1 ) / ZONE_CHUNK_PAGES; ++chunk )
+	{
+		if( !_chunk_is_online( chunk ) )
+		{
+			_chunk_init( chunk );
+		}
+	}
+}
+
+/* same as above for a single page without holding the zone lock */
+static void
+_chunk_online_locked( uint64_t pfn )
+{
+	if( !_chunk_is_online( pfn / ZONE_CHUNK_PAGES ) )
+	{
+		auto z = _zone_of( pfn );
+		zone_lock lock( z );
+
+		_chunk_online_range( pfn, 1 );
+	}
+}
+
+/* (re)build the free lists from the bitmap, offline chunks are skipped */
+static void
+_buddy_init( void )
+{
+	uint64_t limit = _memory_map_size * 8ULL;
+
+	for( unsigned i = 0; i < _zone_count; ++i )
+	{
+		for( unsigned o = 0; o <= PHYSMM_MAX_ORDER; ++o )
+		{
+			INIT_LIST( _zones[i].free_area[o] );
+			_zones[i].free_area_count[o] = 0;
+		}
+	}
+	_buddy_pages = limit;
+
+	for( uint64_t pfn = 0; pfn < limit; pfn += ZONE_CHUNK_PAGES )
+	{
+		if( _chunk_is_online( pfn / ZONE_CHUNK_PAGES ) )
+		{
+			_buddy_add_free( pfn, ( pfn + ZONE_CHUNK_PAGES < limit ) ? pfn + ZONE_CHUNK_PAGES : limit );
+		}
+	}
+	_buddy_active = true;
+}
+
+/* release [pfn, pfn + count) skipping pages that are already free */
+static void
+_release_range( uint64_t pfn, uint64_t count )
+{
+	uint64_t limit = pfn + count;
+
+	_chunk_online_range( pfn, count );
+	while( ( pfn = _find_next_used( pfn, limit ) ) < limit )
+	{
+		uint64_t end = _find_next_free( pfn, limit );
+
+		_mark_free_bits( pfn, end - pfn );
+		_free_page_range( pfn * PAGE_SIZE, ( end - pfn ) * PAGE_SIZE );
+		if( _buddy_active )
+		{
+			_buddy_free_range( pfn, end - pfn );
+		}
+		pfn = end;
+	}
+}
+
+/* allocate a single page from z, returns the physical address or 0
+ * the caller has to hold the zone lock */
+static phys_addr_t
+_alloc_page( struct zone *z )
+{
+	phys_addr_t addr = ( _zone_free( z ) > 0 ) ? _search_first_free( z ) : 0;
+
+	if( addr != 0 )
+	{
+		_chunk_online_range( addr / PAGE_SIZE, 1 );
+		if( _buddy_active )
+		{
+			_buddy_carve( addr / PAGE_SIZE, 1 );
+		}
+		_mark_used_range( addr, PAGE_SIZE );
+	}
+	return addr;
+}
+
+/* allocate count contiguous pages from z, returns the physical address or 0 */
+static phys_addr_t
+_alloc_range( struct zone *z, unsigned count )
+{
+	phys_addr_t addr = 0;
+	zone_lock lock( z );
+
+	if( _zone_free( z ) < count )
+	{
+		return 0;
+	}
+
+	if( _buddy_active && count <= ( 1U << PHYSMM_MAX_ORDER ) )
+	{
+		unsigned order = _buddy_order( count );
+		uint64_t pfn;
+
+		if( _buddy_alloc( z, order, pfn ) )
+		{
+			/* hand back the unused tail of the block */
+			if( count < ( 1ULL << order ) )
+			{
+				_buddy_free_range( pfn + count, ( 1ULL << order ) - count );
+			}
+			addr = pfn * PAGE_SIZE;
+		}
+	}
+
+	if( addr == 0 )
+	{
+		/* too big for the buddy allocator or only available unaligned */
+		addr = _search_first_free_range( z, count );
+		if( addr == 0 )
+		{
+			return 0;
+		}
+		_chunk_online_range( addr / PAGE_SIZE, count );
+		if( _buddy_active )
+		{
+			_buddy_carve( addr / PAGE_SIZE, count );
+		}
+	}
+
+	_mark_used_range( addr, PAGE_SIZE * count );
+	return addr;
+}
+
+/* length of the run of set bits starting at the lowest set bit of mask */
+static inline unsigned
+_word_run( uint64_t mask, unsigned start )
+{
+	uint64_t rest = ~( mask >> start );
+
+	return ( rest == 0 ) ? MAP_WORD_BITS - start : __builtin_ctzll( rest );
+}
+
+/* take up to count single pages from z one bitmap word at a time and store
+ * their physical addresses in out, returns the number of pages taken
+ * the caller has to hold the zone lock */
+static unsigned
+_alloc_bulk( struct zone *z, unsigned count, void *out[] )
+{
+	uint64_t limit = _zone_limit( z ) / MAP_WORD_BITS;
+	uint64_t word  = _next_nonfull_word( z->hint, limit );
+	unsigned n     = 0;
+
+	if( word > z->hint )
+	{
+		z->hint = word;
+	}
+
+	while( n < count && word < limit )
+	{
+		/* page 0 is never handed out */
+		uint64_t free = ~_memory_map_data[word] & ( ( word == 0 ) ? ~1ULL : MAP_WORD_FULL );
+		uint64_t take = 0;
+
+		for( ; free != 0 && n < count; free &= free - 1 )
+		{
+			out[n++] = ( void* )( ( word * MAP_WORD_BITS + __builtin_ctzll( free ) ) * PAGE_SIZE );
+			take    |= free & -free;
+		}
+
+		if( take != 0 )
+		{
+			/* a word never spans chunks */
+			_chunk_online_range( word * MAP_WORD_BITS, 1 );
+			for( uint64_t rest = take; _buddy_active && rest != 0; )
+			{
+				unsigned start = __builtin_ctzll( rest );
+				unsigned run   = _word_run( rest, start );
+
+				_buddy_carve( word * MAP_WORD_BITS + start, run );
+				rest &= ( run + start < MAP_WORD_BITS ) ? ~( ( 1ULL << ( run + start ) ) - 1 ) : 0;
+			}
+			z->used += __builtin_popcountll( take );
+			_memory_map_data[word] |= take;
+			_summary_update( word );
+		}
+		word = _next_nonfull_word( word + 1, limit );
+	}
+	return n;
+}
+
+/* release the pages set in mask from one bitmap word of z
+ * the caller has to hold the zone lock */
+static void
+_release_word( struct zone *z, uint64_t word, uint64_t mask )
+{
+	/* pages that are free already are ignored */
+	mask &= _memory_map_data[word];
+	if( mask == 0 )
+	{
+		return;
+	}
+
+	_chunk_online_range( word * MAP_WORD_BITS, 1 );
+	if( word < z->hint )
+	{
+		z->hint = word;
+	}
+	z->used -= __builtin_popcountll( mask );
+	_memory_map_data[word] &= ~mask;
+	_summary_update( word );
+
+	while( mask != 0 )
+	{
+		unsigned start = __builtin_ctzll( mask );
+		unsigned run   = _word_run( mask, start );
+		uint64_t pfn   = word * MAP_WORD_BITS + start;
+
+		_free_page_range( pfn * PAGE_SIZE, run * PAGE_SIZE );
+		if( _buddy_active )
+		{
+			_buddy_free_range( pfn, run );
+		}
+		mask &= ( run + start < MAP_WORD_BITS ) ? ~( ( 1ULL << ( run + start ) ) - 1 ) : 0;
+	}
+}
+
+/* release [pfn, pfn + count) taking the lock of each zone touched */
+static void
+_release_range_locked( uint64_t pfn, uint64_t count )
+{
+	while( count > 0 )
+	{
+		auto z = _zone_of( pfn );
+		uint64_t span = ( pfn + count <= z->end ) ? count : z->end - pfn;
+
+		_zone_lock( z );
+		_release_range( pfn, span );
+		_zone_unlock( z );
+
+		pfn   += span;
+		count -= span;
+	}
+}
+
+/* single pages released in one go, pages sharing a bitmap word are cleared
+ * at once and the zone lock is only switched when the zone changes */
+struct release_batch
+{
+	struct zone *z = nullptr;
+	uint64_t word  = 0;
+	uint64_t mask  = 0;
+};
+
+static void
+_release_batch_add( struct release_batch *batch, uint64_t pfn )
+{
+	if( batch->z != nullptr && pfn / MAP_WORD_BITS == batch->word )
+	{
+		batch->mask |= 1ULL << ( pfn % MAP_WORD_BITS );
+		return;
+	}
+	if( batch->z != nullptr )
+	{
+		_release_word( batch->z, batch->word, batch->mask );
+		if( batch->z != _zone_of( pfn ) )
+		{
+			_zone_unlock( batch->z );
+			batch->z = nullptr;
+		}
+	}
+	if( batch->z == nullptr )
+	{
+		batch->z = _zone_of( pfn );
+		_zone_lock( batch->z );
+	}
+	batch->word = pfn / MAP_WORD_BITS;
+	batch->mask = 1ULL << ( pfn % MAP_WORD_BITS );
+}
+
+static void
+_release_batch_end( struct release_batch *batch )
+{
+	if( batch->z != nullptr )
+	{
+		_release_word( batch->z, batch->word, batch->mask );
+		_zone_unlock( batch->z );
+		batch->z = nullptr;
+	}
+}
+
+static inline struct page_cache*
+_local_page_cache( void )
+{
+	if( !_page_cache_enabled )
+	{
+		return nullptr;
+	}
+#ifdef KERNEL
+	return &processor::core::current()->page_cache;
+#else
+	return &_host_page_cache;
+#endif
+}
+
+/* the local cache may only be touched with interrupts disabled */
+static inline uint64_t
+_page_cache_enter( void )
+{
+#ifdef KERNEL
+	uint64_t state = processor::core::read_flags();
+	processor::core::disable_interrupts();
+	return state;
+#else
+	return 0;
+#endif
+}
+
+static inline void
+_page_cache_leave( uint64_t state )
+{
+#ifdef KERNEL
+	processor::core::write_flags( state );
+#else
+	( void )state;
+#endif
+}
+
+/* cached pages keep their bitmap bit, kCached tells them apart from
+ * allocated ones so a second free can be caught */
+static inline void
+_page_cache_flag( phys_addr_t addr, bool cached )
+{
+	if( _section_map != nullptr )
+	{
+		_page_map( addr / PAGE_SIZE )->flags = ( cached ) ? __PPF( Unused ) | __PPF( Cached )
+		                                                  : __PPF( Unused );
+	}
+}
+
+static inline bool
+_page_cache_holds( uint64_t pfn )
+{
+	return _section_map != nullptr && _section_map[pfn >> SECTION_SHIFT] != nullptr &&
+	       flag_set( _page_map( pfn )->flags, __PPF( Cached ) );
+}
+
+static inline void
+_page_cache_push_hot( struct page_cache *pcp, phys_addr_t addr )
+{
+	pcp->head = ( pcp->head + 1 ) & ( PHYSMM_PCP_SIZE - 1 );
+	pcp->pages[pcp->head] = addr;
+	pcp->count++;
+	_page_cache_flag( addr, true );
+}
+
+static inline void
+_page_cache_push_cold( struct page_cache *pcp, phys_addr_t addr )
+{
+	pcp->pages[( pcp->head - pcp->count ) & ( PHYSMM_PCP_SIZE - 1 )] = addr;
+	pcp->count++;
+	_page_cache_flag( addr, true );
+}
+
+static inline phys_addr_t
+_page_cache_pop_hot( struct page_cache *pcp )
+{
+	phys_addr_t addr = pcp->pages[pcp->head];
+
+	pcp->head = ( pcp->head - 1 ) & ( PHYSMM_PCP_SIZE - 1 );
+	pcp->count--;
+	_page_cache_flag( addr, false );
+	return addr;
+}
+
+static inline phys_addr_t
+_page_cache_pop_cold( struct page_cache *pcp )
+{
+	pcp->count--;
+
+	phys_addr_t addr = pcp->pages[( pcp->head - pcp->count ) & ( PHYSMM_PCP_SIZE - 1 )];
+	_page_cache_flag( addr, false );
+	return addr;
+}
+
+/* pages from this zone may be kept in the local cache */
+static inline bool
+_page_cache_zone( const struct zone *z, unsigned node )
+{
+	return z->type != ZONE_DMA && z->node == node;
+}
+
+/* move up to PHYSMM_PCP_BATCH free pages of the local node into the cold end
+ * of pcp, DMA zones are left alone - they are only used on explicit request */
+static void
+_page_cache_refill( struct page_cache *pcp )
+{
+	unsigned node = _local_node();
+	unsigned want = PHYSMM_PCP_BATCH;
+
+	for( auto list = _zone_lists[node][ZONE_NORMAL]; *list != ZONE_LIST_END && want > 0; ++list )
+	{
+		auto z = &_zones[*list];
+		if( !_page_cache_zone( z, node ) )
+		{
+			continue;
+		}
+
+		zone_lock lock( z );
+		for( ; want > 0 && pcp->count < PHYSMM_PCP_SIZE; --want )
+		{
+			phys_addr_t addr = _alloc_page( z );
+			if( addr == 0 )
+			{
+				break;
+			}
+			_page_cache_push_cold( pcp, addr );
+		}
+	}
+}
+
+/* return up to count pages from the cold end of pcp to the bitmap,
+ * sorted so each zone lock and bitmap word is only taken once */
+static void
+_page_cache_drain( struct page_cache *pcp, unsigned count )
+{
+	uint64_t pfns[PHYSMM_PCP_SIZE];
+	unsigned n = 0;
+	struct release_batch batch;
+
+	for( ; count > 0 && pcp->count > 0; --count )
+	{
+		uint64_t pfn = _page_cache_pop_cold( pcp ) / PAGE_SIZE;
+		unsigned i   = n++;
+
+		for( ; i > 0 && pfns[i - 1] > pfn; --i )
+		{
+			pfns[i] = pfns[i - 1];
+		}
+		pfns[i] = pfn;
+	}
+
+	for( unsigned i = 0; i < n; ++i )
+	{
+		_release_batch_add( &batch, pfns[i] );
+	}
+	_release_batch_end( &batch );
+}
+
+/* clear a page bypassing the caches, page has to be page aligned */
+static void
+_zero_page_nt( void *page )
+{
+	for( auto p = ( uint64_t* )page; p < ( uint64_t* )( ( uintptr_t )page + PAGE_SIZE ); p += 4 )
+	{
+		__asm__ __volatile__( "movnti %1,  0(%0)\n"
+		                      "movnti %1,  8(%0)\n"
+		                      "movnti %1, 16(%0)\n"
+		                      "movnti %1, 24(%0)\n"
+		                      :: "r"( p ), "r"( 0ULL ) : "memory" );
+	}
+	/* order the stores before the page is handed out */
+	__asm__ __volatile__( "sfence" ::: "memory" );
+}
+
+/* clear pages on the spot, the caller is going to use them right away */
+static inline void
+_zero_pages( phys_addr_t addr, unsigned count )
+{
+#ifdef KERNEL
+	memset( ( void* )( addr + _memory_map_base ), 0, PAGE_SIZE * count );
+#else
+	( void )addr;
+	( void )count;
+#endif
+}
+
+static phys_addr_t
+_zero_pool_pop( void )
+{
+	scoped_lock lock( _zero_pool_lock );
+
+	return ( _zero_pool_count > 0 ) ? _zero_pool[--_zero_pool_count] : 0;
+}
+
+/* hand all pooled pages back to their zones */
+static void
+_zero_pool_drain( void )
+{
+	phys_addr_t addr;
+
+	while( ( addr = _zero_pool_pop() ) != 0 )
+	{
+		_release_range_locked( addr / PAGE_SIZE, 1 );
+	}
+}
+
+static void
+_zone_lock_all( void )
+{
+	for( auto &z : _zones )
+	{
+		z.lock.lock();
+	}
+}
+
+static void
+_zone_unlock_all( void )
+{
+	for( auto &z : _zones )
+	{
+		z.lock.unlock();
+	}
+}
+
+#ifdef KERNEL
+
+/* first run of count free pages in [pfn, limit) or 0 */
+static uint64_t
+_find_free_run( uint64_t pfn, uint64_t limit, uint64_t count )
+{
+	while( ( pfn = _find_next_free( pfn, limit ) ) < limit )
+	{
+		uint64_t end = _find_next_used( pfn, limit );
+
+		if( end - pfn >= count )
+		{
+			return pfn;
+		}
+		pfn = end;
+	}
+	return 0;
+}
+
+/* allocate the page map of every section that contains usable RAM
+ * Sections reachable through the boot mapping keep their page map inside of
+ * it, all others are only touched once set_physical_base_offset() ran.
+ */
+static void
+_section_setup( void )
+{
+	uint64_t limit  = _memory_map_size * 8ULL;
+	uint64_t mapped = BOOT_MAX_MAPPED / PAGE_SIZE;
+	uint64_t pages  = ( SECTION_PAGES * sizeof( page_map_t ) + PAGE_SIZE - 1 ) / PAGE_SIZE;
+	uint64_t used   = 0;
+
+	for( uint64_t section = 0; section < _section_count; ++section )
+	{
+		uint64_t start = section << SECTION_SHIFT;
+		uint64_t end   = ( start + SECTION_PAGES < limit ) ? start + SECTION_PAGES : limit;
+
+		_section_map[section] = nullptr;
+		if( _find_next_free( start, end ) >= end )
+		{
+			continue;
+		}
+
+		uint64_t pfn = _find_free_run( start, ( start < mapped && end > mapped ) ? mapped : end, pages );
+		if( pfn == 0 )
+		{
+			/* too fragmented, fall back to low memory */
+			pfn = _find_free_run( 1, ( limit < mapped ) ? limit : mapped, pages );
+		}
+		if( pfn == 0 )
+		{
+			panic( "not enough free RAM to initialize page map!" );
+		}
+		_mark_used_range( pfn * PAGE_SIZE, pages * PAGE_SIZE );
+		_section_map[section] = ( page_map_t* )( pfn * PAGE_SIZE );
+		used += pages;
+	}
+
+	log::printk( "%lu KB used for page map data ( %lu KB without sections )\n",
+	             used * PAGE_SIZE / 1024, limit * sizeof( page_map_t ) / 1024 );
+}
+
+void
+init( const multiboot_info_t *boot_info )
+{
+	uint64_t mem_available = 0;
+	phys_addr_t first_free = 0, first_chunk_above_1mb = 0, last_chunk_end = 0;
+	multiboot_memory_map_t *mem_map;
+
+	/* I should go and kill one of the multiboot spec authors..
+	 * map + map->size + sizeof( map->size ) -- what the hell did you smoke?
+	 */
+	log::printk( "loader provided memory map:\n" );
+	log::printk( "-----------------------------------------\n" );
+	mem_map = ( multiboot_memory_map_t* )( ( uintptr_t ) boot_info->mmap_addr );
+	do
+	{
+		if( mem_map->type == MULTIBOOT_MEMORY_AVAILABLE )
+		{
+			if( first_chunk_above_1mb == 0 && mem_map->addr >= 0x100000 )
+			{
+				first_chunk_above_1mb = mem_map->addr + mem_map->len;
+				if( first_chunk_above_1mb > BOOT_MAX_MAPPED )
+				{
+					first_chunk_above_1mb = BOOT_MAX_MAPPED;
+				}
+			}
+			if( last_chunk_end < mem_map->addr + mem_map-> len )
+			{
+				last_chunk_end = mem_map->addr + mem_map-> len;
+			}
+			mem_available += mem_map->len;
+		}
+		memory_upper_bound = mem_map->addr + mem_map->len;
+		/*
+		* #define E820_RAM	1
+		* #define E820_RESERVED	2
+		* #define E820_ACPI	3
+		* #define E820_NVS	4
+		* #define E820_UNUSABLE	5
+		*/
+		log::printk( "%#016llx - %#016llx, %s (%2d)\n",
+		             mem_map->addr, mem_map->addr + mem_map->len,
+		             mem_map->type == 1 ? "free" : "rsvd",
+		             mem_map->type );
+
+		mem_map = ( multiboot_memory_map_t* )( ( uintptr_t )mem_map + mem_map->size + sizeof( mem_map->size ) );
+	} while( ( uintptr_t)mem_map < boot_info->mmap_addr + boot_info->mmap_length );
+
+	/* the bitmap is processed in 64bit words */
+	_memory_map_size  = ( last_chunk_end / PAGE_SIZE + MAP_WORD_BITS - 1 ) / MAP_WORD_BITS;
+	_memory_map_size *= sizeof( _memory_map_data[0] );
+	/* memory_upper_bound should be the end of the physical address space
+	 * the line below makes it the last *usable* physical memory. */
+	/* memory_upper_bound = last_chunk_end; */
+
+	if( last_chunk_end < 0x1000000 )
+	{
+		/* FIXME: this *will fail* due to BIOS / chipset mappings
+		 *        if there are exactly 16MB installed..
+		 */
+		panic( "not enough physical RAM installed at least 16MB are required!\n" );
+	}
+
+	log::printk( "-----------------------------------------\n" );
+	log::printk( "%lu MB usable RAM\n", mem_available / 0x100000 );
+	log::printk( "%u KB required for physical bitmap\n", _memory_map_size / 1024 );
+	log::printk( "-----------------------------------------\n" );
+
+	/* check for the first free location that has enough space */
+	first_free  = ( uintptr_t )__end - KERNEL_VMA;
+
+	if( boot_info-> flags & MULTIBOOT_INFO_MODS )
+	{
+		multiboot_module_t *mod_list = ( multiboot_module_t* )( ( uintptr_t )boot_info->mods_addr );
+		for( size_t i = 0; i < boot_info->mods_count; ++i )
+		{
+			if( mod_list[i].mod_start > first_free )
+			{
+				first_free = mod_list[i].mod_end;
+				if( ( uintptr_t )mod_list[i].cmdline > first_free )
+				{
+					auto cmdline = ( const char* )( ( uintptr_t )mod_list[i].cmdline );
+					first_free = mod_list[i].cmdline + strlen( cmdline );
+				}
+			}
+		}
+	}
+
+	/* only the bitmaps and the section table have to live in the boot
+	 * mapping, the page map is allocated per section by _section_setup() */
+	_section_count = ( _memory_map_size * 8ULL + SECTION_PAGES - 1 ) / SECTION_PAGES;
+
+	auto summary_size  = _map_summary_words() * sizeof( _memory_map_summary[0] );
+	auto chunk_size    = ( _memory_map_size * 8ULL / ZONE_CHUNK_PAGES + 8 ) & ~7ULL;
+	auto section_size  = _section_count * sizeof( _section_map[0] );
+	auto meta_size     = _memory_map_size + summary_size + chunk_size + section_size;
+	if( first_free + meta_size > first_chunk_above_1mb )
+	{
+		panic( "not enough free RAM to initialize memory bitmap!" );
+	}
+	first_free += sizeof( phys_addr_t );
+	first_free &= ~( sizeof( uint64_t ) - 1 );
+	_memory_map_data    = ( uint64_t* )first_free;
+	_memory_map_summary = ( uint64_t* )( first_free + _memory_map_size );
+	_chunk_online       = ( uint8_t* )( first_free + _memory_map_size + summary_size );
+	_section_map        = ( page_map_t** )( first_free + _memory_map_size + summary_size + chunk_size );
+
+	/* the page map itself is initialized on demand, see _chunk_init() */
+	memset( _memory_map_data, 0xff, _memory_map_size );
+	memset( _chunk_online, 0, chunk_size );
+	_zone_setup();
+
+	first_free += meta_size + PAGE_SIZE;
+	first_free &= 0x7ffff000;
+
+	/* second iteration, mark non-reserved memory above first_free as available */
+	mem_map = ( multiboot_memory_map_t* )( ( uintptr_t ) boot_info->mmap_addr );
+	do
+	{
+		if( mem_map->addr < first_free && 
+		    mem_map->addr + mem_map->len > first_free )
+		{
+			mem_map->len -= first_free - mem_map->addr;
+			mem_map->addr = first_free;
+		}
+
+		if( mem_map->type == MULTIBOOT_MEMORY_AVAILABLE && 
+		    mem_map->addr >= first_free )
+		{
+			_mark_free_range( mem_map->addr, mem_map->len );
+		}
+
+		mem_map = ( multiboot_memory_map_t* )( ( uintptr_t )mem_map + mem_map->size + sizeof( mem_map->size ) );
+	} while( ( uintptr_t)mem_map < boot_info->mmap_addr + boot_info->mmap_length );
+
+	_section_setup();
+
+	log::printk( "Physical memory map at %p\n"
+	             "Page metadata sections at %p\n"
+	             "-- %u entries, %u free (spanning %lu MB)\n",
+	             _memory_map_data,
+	             _section_map,
+	             _memory_map_size * 8,
+	             free_page_count(),
+	             ( (uintptr_t) PAGE_SIZE * free_page_count() / 0x100000 ) );
+
+	for( unsigned i = 0; i < _zone_count; ++i )
+	{
+		auto z = &_zones[i];
+		log::printk( "-- zone %s: %#016lx - %#016lx, %lu free\n",
+		             z->name, z->start * PAGE_SIZE, z->end * PAGE_SIZE, _zone_free( z ) );
+	}
+}
+
+#endif
+
+void
+set_physical_base_offset( const phys_addr_t offset )
+{
+	/* change the expected location of the memory map and set the offset for
+	 * physical addresses used alloc_page() and free_page()
+	 */
+	_memory_map_data    = ( uint64_t* )( ( uintptr_t )_memory_map_data - _memory_map_base + offset );
+	_memory_map_summary = ( uint64_t* )( ( uintptr_t )_memory_map_summary - _memory_map_base + offset );
+	_chunk_online       = ( uint8_t* )( ( uintptr_t )_chunk_online - _memory_map_base + offset );
+	_section_map        = ( page_map_t** )( ( uintptr_t )_section_map - _memory_map_base + offset );
+
+	for( uint64_t section = 0; section < _section_count; ++section )
+	{
+		if( _section_map[section] != nullptr )
+		{
+			_section_map[section] = ( page_map_t* )( ( uintptr_t )_section_map[section] - _memory_map_base + offset );
+		}
+	}
+	_memory_map_base    = offset;
+
+	log::printk( "Physical memory map relocated to %p\n", _memory_map_data );
+	log::printk( "Page metadata sections relocated to %p\n", _section_map );
+
+#ifdef KERNEL
+	/* the free lists link page_map_t entries by address, so they are only
+	 * built once the page map reached its final location */
+	if( !_buddy_active )
+	{
+		_zone_lock_all();
+		_buddy_init();
+		_zone_unlock_all();
+	}
+#endif
+}
+
+phys_addr_t 
+physical_base_offset( void )
+{
+	return _memory_map_base;
+}
+
+void
+init_page_cache( void )
+{
+	_page_cache_enabled = true;
+
+	auto pcp = _local_page_cache();
+	memset( pcp, 0, sizeof( *pcp ) );
+}
+
+void
+drain_page_cache( void )
+{
+	auto pcp = _local_page_cache();
+
+	if( pcp != nullptr )
+	{
+		uint64_t state = _page_cache_enter();
+		_page_cache_drain( pcp, PHYSMM_PCP_SIZE );
+		_page_cache_leave( state );
+	}
+}
+
+void
+init_numa( const struct node_range ranges[], unsigned range_count,
+           const uint8_t distance[], unsigned node_count )
+{
+	/* distance[] is laid out for all nodes, even those beyond the limit */
+	unsigned stride = node_count;
+
+	if( node_count > PHYSMM_MAX_NODES )
+	{
+		log::printk( "physmm: limiting %u NUMA nodes to %u\n", node_count, PHYSMM_MAX_NODES );
+		node_count = PHYSMM_MAX_NODES;
+	}
+	if( range_count > PHYSMM_MAX_RANGES )
+	{
+		log::printk( "physmm: ignoring %u NUMA memory ranges\n", range_count - PHYSMM_MAX_RANGES );
+		range_count = PHYSMM_MAX_RANGES;
+	}
+
+	_zone_lock_all();
+
+	_node_count       = ( node_count > 0 ) ? node_count : 1;
+	_node_range_count = 0;
+	for( unsigned i = 0; i < range_count; ++i )
+	{
+		if( ranges[i].node < _node_count )
+		{
+			_node_ranges[_node_range_count++] = ranges[i];
+		}
+	}
+	for( unsigned from = 0; from < _node_count; ++from )
+	{
+		for( unsigned to = 0; to < _node_count; ++to )
+		{
+			/* ACPI defaults: 10 for local, 20 for remote access */
+			_node_distance[from][to] = ( distance != nullptr ) ? distance[from * stride + to]
+			                                                   : ( from == to ) ? 10 : 20;
+		}
+	}
+
+	/* rebuild the zones and their free lists from the bitmap */
+	_zone_setup();
+	if( _buddy_active )
+	{
+		_buddy_init();
+	}
+
+	_zone_unlock_all();
+
+	for( unsigned i = 0; i < _zone_count; ++i )
+	{
+		auto z = &_zones[i];
+		log::printk( "physmm: node %u zone %s: %#016lx - %#016lx, %lu free\n",
+		             z->node, z->name, z->start * PAGE_SIZE, z->end * PAGE_SIZE, _zone_free( z ) );
+	}
+}
+
+void
+init_deferred( void )
+{
+	uint64_t chunks = ( _memory_map_size * 8ULL + ZONE_CHUNK_PAGES - 1 ) / ZONE_CHUNK_PAGES;
+	uint64_t count  = 0;
+	uint64_t start  = processor::regs::read_tsc();
+
+	for( uint64_t chunk = 0; chunk < chunks; ++chunk )
+	{
+		if( !_chunk_is_online( chunk ) )
+		{
+			auto z = _zone_of( chunk * ZONE_CHUNK_PAGES );
+			zone_lock lock( z );
+
+			if( !_chunk_is_online( chunk ) )
+			{
+				_chunk_init( chunk );
+				++count;
+			}
+		}
+	}
+	if( count > 0 )
+	{
+		log::printk( "physmm: initialized %lu deferred chunks in %lu cycles\n",
+		             count, processor::regs::read_tsc() - start );
+	}
+}
+
+void
+zero_idle_pages( void )
+{
+	for( ;; )
+	{
+		phys_addr_t addr = 0;
+
+		{
+			scoped_lock lock( _zero_pool_lock );
+			if( _zero_pool_count >= PHYSMM_ZERO_POOL_SIZE )
+			{
+				return;
+			}
+		}
+
+		/* DMA zones are too precious to be parked in the pool */
+		for( auto list = _zone_lists[_local_node()][ZONE_NORMAL];
+		     addr == 0 && *list != ZONE_LIST_END && _zones[*list].type != ZONE_DMA; ++list )
+		{
+			zone_lock lock( &_zones[*list] );
+			addr = _alloc_page( &_zones[*list] );
+		}
+		if( addr == 0 )
+		{
+			return;
+		}
+
+#ifdef KERNEL
+		_zero_page_nt( ( void* )( addr + _memory_map_base ) );
+#endif
+
+		_zero_pool_lock.lock();
+		bool pooled = ( _zero_pool_count < PHYSMM_ZERO_POOL_SIZE );
+		if( pooled )
+		{
+			_zero_pool[_zero_pool_count++] = addr;
+			++_zero_pool_stats.zeroed;
+		}
+		_zero_pool_lock.unlock();
+
+		if( !pooled )
+		{
+			/* somebody else filled the pool in the meantime */
+			_release_range_locked( addr / PAGE_SIZE, 1 );
+			return;
+		}
+	}
+}
+
+void
+get_zero_pool_stats( struct zero_pool_stats *stats )
 {
-#ifdef KERNEL
+	scoped_lock lock( _zero_pool_lock );
 
-	len /= PAGE_SIZE;
-	do {
-		INIT_LIST( memory_map_pages[__XPA( addr ) >> PAGE_SHIFT].link );
-		memory_map_pages[__XPA( addr ) >> PAGE_SHIFT].flags = flags;
-
-		addr += PAGE_SIZE;
-	} while( len-- );
-
-#endif
+	*stats        = _zero_pool_stats;
+	stats->hits   = __atomic_load_n( &_zero_pool_stats.hits, __ATOMIC_RELAXED );
+	stats->misses = __atomic_load_n( &_zero_pool_stats.misses, __ATOMIC_RELAXED );
+	stats->pooled = _zero_pool_count;
 }
 
-static void
-_free_page_range( phys_addr_t addr, size_t len )
+unsigned
+zone_count( void )
 {
-#ifdef KERNEL
+	return _zone_count;
+}
 
-	len /= PAGE_SIZE;
-	do {
-		memset( &memory_map_pages[__XPA( addr ) >> PAGE_SHIFT], 0, sizeof( page_map_t ) );
-		memory_map_pages[__XPA( addr ) >> PAGE_SHIFT].flags = __PPF( Unused );
+bool
+get_zone_stats( unsigned index, struct zone_stats *stats )
+{
+	if( index >= _zone_count )
+	{
+		return false;
+	}
 
-		addr += PAGE_SIZE;
-	} while( len-- );
+	auto z = &_zones[index];
+	memset( stats, 0, sizeof( *stats ) );
 
-#endif
-}
+	/* the counters are only read, don't skew the lock statistics */
+	z->lock.lock();
 
-#ifdef KERNEL
+	stats->name       = z->name;
+	stats->node       = z->node;
+	stats->start      = z->start * PAGE_SIZE;
+	stats->end        = z->end * PAGE_SIZE;
+	stats->free_pages = _zone_free( z );
+	for( unsigned order = 0; order <= PHYSMM_MAX_ORDER; ++order )
+	{
+		stats->alloc_count[order] = __atomic_load_n( &z->stats.alloc[order], __ATOMIC_RELAXED );
+		stats->free_count[order]  = __atomic_load_n( &z->stats.free[order], __ATOMIC_RELAXED );
+	}
+	stats->alloc_failed     = __atomic_load_n( &z->stats.failed, __ATOMIC_RELAXED );
+	stats->lock_count       = z->stats.locks;
+	stats->lock_wait_cycles = z->stats.lock_wait;
+	stats->lock_hold_cycles = z->stats.lock_hold;
 
-void
-init( const multiboot_info_t *boot_info )
-{
-	uint64_t mem_available = 0;
-	phys_addr_t first_free = 0, first_chunk_above_1mb = 0, last_chunk_end = 0;
-	multiboot_memory_map_t *mem_map;
+	/* the bitmap is authoritative, the free lists might not cover the
+	 * deferred chunks yet */
+	uint64_t usable[PHYSMM_MAX_ORDER + 1] = { 0 };
+	uint64_t pfn = ( z->start > 0 ) ? z->start : 1;
 
-	/* I should go and kill one of the multiboot spec authors..
-	 * map + map->size + sizeof( map->size ) -- what the hell did you smoke?
-	 */
-	log::printk( "loader provided memory map:\n" );
-	log::printk( "-----------------------------------------\n" );
-	mem_map = ( multiboot_memory_map_t* )( ( uintptr_t ) boot_info->mmap_addr );
-	do
+	while( ( pfn = _find_next_free( pfn, z->end ) ) < z->end )
 	{
-		if( mem_map->type == MULTIBOOT_MEMORY_AVAILABLE )
+		uint64_t end = _find_next_used( pfn, z->end );
+		uint64_t run = end - pfn;
+
+		if( run > stats->largest_free_run )
 		{
-			if( first_chunk_above_1mb == 0 && mem_map->addr >= 0x100000 )
-			{
-				first_chunk_above_1mb = mem_map->addr + mem_map->len;
-				if( first_chunk_above_1mb > BOOT_MAX_MAPPED )
-				{
-					first_chunk_above_1mb = BOOT_MAX_MAPPED;
-				}
-			}
-			if( last_chunk_end < mem_map->addr + mem_map-> len )
-			{
-				last_chunk_end = mem_map->addr + mem_map-> len;
-			}
-			mem_available += mem_map->len;
+			stats->largest_free_run = run;
 		}
-		memory_upper_bound = mem_map->addr + mem_map->len;
-		/*
-		* #define E820_RAM	1
-		* #define E820_RESERVED	2
-		* #define E820_ACPI	3
-		* #define E820_NVS	4
-		* #define E820_UNUSABLE	5
-		*/
-		log::printk( "%#016llx - %#016llx, %s (%2d)\n",
-		             mem_map->addr, mem_map->addr + mem_map->len,
-		             mem_map->type == 1 ? "free" : "rsvd",
-		             mem_map->type );
-
-		mem_map = ( multiboot_memory_map_t* )( ( uintptr_t )mem_map + mem_map->size + sizeof( mem_map->size ) );
-	} while( ( uintptr_t)mem_map < boot_info->mmap_addr + boot_info->mmap_length );
+		for( unsigned order = 0; order <= PHYSMM_MAX_ORDER; ++order )
+		{
+			usable[order] += run & ~( ( 1ULL << order ) - 1 );
+		}
+		pfn = end;
+	}
 
-	_memory_map_size = last_chunk_end / PAGE_SIZE / 8;
-	/* memory_upper_bound should be the end of the physical address space
-	 * the line below makes it the last *usable* physical memory. */
-	/* memory_upper_bound = last_chunk_end; */
+	z->lock.unlock();
 
-	if( last_chunk_end < 0x1000000 )
+	for( unsigned order = 0; order <= PHYSMM_MAX_ORDER && stats->free_pages > 0; ++order )
 	{
-		/* FIXME: this *will fail* due to BIOS / chipset mappings
-		 *        if there are exactly 16MB installed..
-		 */
-		panic( "not enough physical RAM installed at least 16MB are required!\n" );
+		stats->fragmentation[order] = ( stats->free_pages - usable[order] ) * 1000 / stats->free_pages;
 	}
+	return true;
+}
 
-	log::printk( "-----------------------------------------\n" );
-	log::printk( "%lu MB usable RAM\n", mem_available / 0x100000 );
-	log::printk( "%u KB required for physical bitmap\n", _memory_map_size / 1024 );
-	log::printk( "%lu MB required for page map data\n", sizeof( page_map_t ) * _memory_map_size * 8 / 1024 / 1024 );
-	log::printk( "-----------------------------------------\n" );
-
-	/* check for the first free location that has enough space */
-	first_free  = ( uintptr_t )__end - KERNEL_VMA;
+void
+dump_stats( void )
+{
+	struct zone_stats stats;
 
-	if( boot_info-> flags & MULTIBOOT_INFO_MODS )
+	for( unsigned i = 0; get_zone_stats( i, &stats ); ++i )
 	{
-		multiboot_module_t *mod_list = ( multiboot_module_t* )( ( uintptr_t )boot_info->mods_addr );
-		for( size_t i = 0; i < boot_info->mods_count; ++i )
+		log::printk( "physmm: node %u zone %s: %#016lx - %#016lx\n",
+		             stats.node, stats.name, stats.start, stats.end );
+		log::printk( "-- %lu free, largest free run %lu pages, %lu failed allocations\n",
+		             stats.free_pages, stats.largest_free_run, stats.alloc_failed );
+		log::printk( "-- lock taken %lu times, %lu cycles waiting, %lu cycles held\n",
+		             stats.lock_count, stats.lock_wait_cycles, stats.lock_hold_cycles );
+		for( unsigned order = 0; order <= PHYSMM_MAX_ORDER; ++order )
 		{
-			if( mod_list[i].mod_start > first_free )
-			{
-				first_free = mod_list[i].mod_end;
-				if( ( uintptr_t )mod_list[i].cmdline > first_free )
-				{
-					auto cmdline = ( const char* )( ( uintptr_t )mod_list[i].cmdline );
-					first_free = mod_list[i].cmdline + strlen( cmdline );
-				}
-			}
+			log::printk( "-- order %2u: %10lu allocs %10lu frees, %3u.%u%% unusable\n",
+			             order, stats.alloc_count[order], stats.free_count[order],
+			             stats.fragmentation[order] / 10, stats.fragmentation[order] % 10 );
 		}
 	}
+}
+
+uint32_t
+free_page_count( void )
+{
+	uint64_t count = 0;
 
-	auto page_map_size = sizeof( page_map_t ) * _memory_map_size * 8;
-	if( first_free + _memory_map_size + page_map_size > first_chunk_above_1mb )
+	for( unsigned i = 0; i < _zone_count; ++i )
 	{
-		panic( "not enough free RAM to initialize memory bitmap!" );
+		count += _zone_free( &_zones[i] );
 	}
-	first_free += sizeof( phys_addr_t );
-	_memory_map_data = ( uint32_t* )first_free;
-	memory_map_pages = ( page_map_t* )( first_free + _memory_map_size );
-
-	_memory_map_used = _memory_map_size * 8;
-
-	memset( _memory_map_data, 0xff, _memory_map_size );
+	return count;
+}
 
-	first_free += _memory_map_size + page_map_size + PAGE_SIZE;
-	first_free &= 0x7ffff000;
+uint32_t
+free_page_count( Flags zone )
+{
+	uint64_t count = 0;
+	unsigned type  = _zone_highest( zone );
 
-	/* second iteration, mark non-reserved memory above first_free as available */
-	mem_map = ( multiboot_memory_map_t* )( ( uintptr_t ) boot_info->mmap_addr );
-	do
+	for( unsigned i = 0; i < _zone_count; ++i )
 	{
-		if( mem_map->addr < first_free && 
-		    mem_map->addr + mem_map->len > first_free )
-		{
-			mem_map->len -= first_free - mem_map->addr;
-			mem_map->addr = first_free;
-		}
-
-		if( mem_map->type == MULTIBOOT_MEMORY_AVAILABLE && 
-		    mem_map->addr >= first_free )
-		{
-			_mark_free_range( mem_map->addr, mem_map->len );
-			_free_page_range( mem_map->addr, mem_map->len );
-		}
-		else
+		if( _zones[i].type == type )
 		{
-			_flag_page_range( mem_map->addr, __PPF( Reserved ), mem_map->len );
+			count += _zone_free( &_zones[i] );
 		}
-
-		mem_map = ( multiboot_memory_map_t* )( ( uintptr_t )mem_map + mem_map->size + sizeof( mem_map->size ) );
-	} while( ( uintptr_t)mem_map < boot_info->mmap_addr + boot_info->mmap_length );
-
-	log::printk( "Physical memory map at %p\n"
-	             "Page metadata map at %p\n"
-	             "-- %u entries, %u free (spanning %lu MB)\n",
-	             _memory_map_data,
-	             memory_map_pages,
-	             _memory_map_size * 8,
-	             _memory_map_size * 8 - _memory_map_used,
-	             ( (uintptr_t) PAGE_SIZE * ( _memory_map_size * 8 - _memory_map_used ) / 0x100000 ) );
+	}
+	return count;
 }
 
-#endif
-
-void
-set_physical_base_offset( const phys_addr_t offset )
+/* returns true if the callback managed to free anything */
+static bool
+_reclaim( uint64_t pages )
 {
-	/* change the expected location of the memory map and set the offset for
-	 * physical addresses used alloc_page() and free_page()
-	 */
-	_memory_map_data  = ( uint32_t* )( ( uintptr_t )_memory_map_data - _memory_map_base + offset );
-	memory_map_pages = ( page_map_t* )( ( uintptr_t )memory_map_pages - _memory_map_base + offset );
-	_memory_map_base  = offset;
+	auto reclaim = __atomic_load_n( &_reclaim_callback, __ATOMIC_ACQUIRE );
+	size_t freed = 0;
 
-	log::printk( "Physical memory map relocated to %p\n", _memory_map_data );
-	log::printk( "Page metadata map relocated to %p\n", memory_map_pages );
+	if( reclaim != nullptr && !__atomic_test_and_set( &_reclaim_active, __ATOMIC_ACQUIRE ) )
+	{
+		freed = reclaim( pages );
+		__atomic_clear( &_reclaim_active, __ATOMIC_RELEASE );
+	}
+	return freed > 0;
 }
 
-phys_addr_t 
-physical_base_offset( void )
+/* top up the free pages before the zones run dry */
+static inline void
+_reclaim_watermark( uint64_t count )
 {
-	return _memory_map_base;
+	if( __atomic_load_n( &_reclaim_callback, __ATOMIC_RELAXED ) != nullptr )
+	{
+		uint64_t free = free_page_count();
+
+		if( free < PHYSMM_RECLAIM_WATERMARK + count )
+		{
+			_reclaim( PHYSMM_RECLAIM_WATERMARK + count - free );
+		}
+	}
 }
 
-uint32_t
-free_page_count( void )
+void
+set_reclaim_callback( reclaim_callback reclaim )
 {
-	return _memory_map_size * 8 - _memory_map_used;
+	__atomic_store_n( &_reclaim_callback, reclaim, __ATOMIC_RELEASE );
 }
 
 void*
 alloc_page( Flags flags )
 {
-	phys_addr_t addr;
-	scoped_lock lock( _memory_map_lock );
+	phys_addr_t addr = 0;
+	unsigned zone    = _zone_highest( flags );
+	bool zeroed      = flag_set( flags, __PPF( Zeroed ) );
+	auto pcp         = _local_page_cache();
+	auto list        = _zone_lists[_local_node()][zone];
 
-	if( free_page_count() == 0 )
+	if( zeroed && zone == ZONE_NORMAL && ( addr = _zero_pool_pop() ) != 0 )
 	{
-		return nullptr;
+		__atomic_fetch_add( &_zero_pool_stats.hits, 1, __ATOMIC_RELAXED );
+		zeroed = false;
+	}
+
+	if( addr == 0 && zone == ZONE_NORMAL && pcp != nullptr )
+	{
+		uint64_t state = _page_cache_enter();
+
+		if( pcp->count <= PHYSMM_PCP_LOW )
+		{
+			_page_cache_refill( pcp );
+		}
+		addr = ( pcp->count > 0 ) ? _page_cache_pop_hot( pcp ) : 0;
+		_page_cache_leave( state );
 	}
-	addr = _search_first_free();
 	if( addr == 0 )
 	{
-		return nullptr;
+		_reclaim_watermark( 1 );
 	}
 
-	_mark_used_range( addr, PAGE_SIZE );
-	_flag_page_range( addr, flags, PAGE_SIZE );
+	/* fall back from high to low zones and by distance */
+	for( auto i = list; addr == 0 && *i != ZONE_LIST_END; ++i )
+	{
+		zone_lock lock( &_zones[*i] );
+		addr = _alloc_page( &_zones[*i] );
+	}
+	if( addr == 0 && zone == ZONE_NORMAL && ( addr = _zero_pool_pop() ) != 0 )
+	{
+		/* the pool is just free memory after all */
+		zeroed = false;
+	}
+	if( addr == 0 && _reclaim( 1 ) )
+	{
+		/* last resort, whatever the caches could spare */
+		for( auto i = list; addr == 0 && *i != ZONE_LIST_END; ++i )
+		{
+			zone_lock lock( &_zones[*i] );
+			addr = _alloc_page( &_zones[*i] );
+		}
+	}
+	if( addr == 0 )
+	{
+		_stat_failed( list );
+		return nullptr;
+	}
+	_stat_alloc( addr / PAGE_SIZE, 1 );
 
+	/* the page is owned by the caller now, no lock needed */
+	if( zeroed )
+	{
+		__atomic_fetch_add( &_zero_pool_stats.misses, 1, __ATOMIC_RELAXED );
+		_zero_pages( addr, 1 );
+	}
+	_flag_page_range( addr, flags & ~_request_flags, PAGE_SIZE );
 	return ( void* )( addr + _memory_map_base );
 }
 
 void*
 alloc_page_range( unsigned count, Flags flags )
 {
-	phys_addr_t addr;
+	phys_addr_t addr = 0;
+	auto list        = _zone_lists[_local_node()][_zone_highest( flags )];
 
 	if( count <= 1 )
 	{
 		return alloc_page( flags );
 	}
 
+	_reclaim_watermark( count );
+	for( auto i = list; addr == 0 && *i != ZONE_LIST_END; ++i )
 	{
-		scoped_lock lock( _memory_map_lock );
-
-		if( count < 1 || free_page_count() < count )
+		addr = _alloc_range( &_zones[*i], count );
+	}
+	if( addr == 0 && ( _local_page_cache() != nullptr || _zero_pool_count > 0 ) )
+	{
+		/* pages parked in the local cache or the zero pool might be just
+		 * what is missing */
+		drain_page_cache();
+		_zero_pool_drain();
+		for( auto i = list; addr == 0 && *i != ZONE_LIST_END; ++i )
 		{
-			return nullptr;
+			addr = _alloc_range( &_zones[*i], count );
 		}
-		addr = _search_first_free_range( count );
-		if( addr == 0 )
+	}
+	if( addr == 0 && _reclaim( count ) )
+	{
+		for( auto i = list; addr == 0 && *i != ZONE_LIST_END; ++i )
 		{
-			return nullptr;
+			addr = _alloc_range( &_zones[*i], count );
 		}
-
-		_mark_used_range( addr, PAGE_SIZE * count );
-		_flag_page_range( addr, flags, PAGE_SIZE * count );
 	}
+	if( addr == 0 )
+	{
+		_stat_failed( list );
+		return nullptr;
+	}
+	_stat_alloc( addr / PAGE_SIZE, count );
 
+	if( flag_set( flags, __PPF( Zeroed ) ) )
+	{
+		_zero_pages( addr, count );
+	}
+	_flag_page_range( addr, flags & ~_request_flags, PAGE_SIZE * count );
 	return ( void* )( addr + _memory_map_base );
 }
 
-void
-free_page( const void* page )
+unsigned
+alloc_pages_bulk( unsigned count, Flags flags, void *pages[] )
 {
-	phys_addr_t addr = ( phys_addr_t )page;
+	unsigned zone = _zone_highest( flags );
+	bool zeroed   = flag_set( flags, __PPF( Zeroed ) );
+	auto list     = _zone_lists[_local_node()][zone];
+	unsigned n    = 0, pooled = 0;
 
-	if( addr >= _memory_map_base )
+	_reclaim_watermark( count );
+	if( zeroed && zone == ZONE_NORMAL )
 	{
-		addr -= _memory_map_base;
+		phys_addr_t addr;
+
+		while( pooled < count && ( addr = _zero_pool_pop() ) != 0 )
+		{
+			pages[pooled++] = ( void* )addr;
+		}
+		__atomic_fetch_add( &_zero_pool_stats.hits, pooled, __ATOMIC_RELAXED );
 	}
 
-	if( addr < PAGE_SIZE )
+	/* one lock round trip per zone instead of one per page */
+	for( n = pooled; n < count && *list != ZONE_LIST_END; ++list )
 	{
-		/* prevent freeing of the first 4K */
-		return;
+		zone_lock lock( &_zones[*list] );
+		n += _alloc_bulk( &_zones[*list], count - n, &pages[n] );
 	}
-	if( addr / PAGE_SIZE / 32 + addr / PAGE_SIZE % 32 > _memory_map_size * 8 )
+	if( zeroed && n > pooled )
 	{
-		/* prevent out-of-bounds access */
-		return;
+		__atomic_fetch_add( &_zero_pool_stats.misses, n - pooled, __ATOMIC_RELAXED );
+	}
+	if( n < count )
+	{
+		_stat_failed( _zone_lists[_local_node()][zone] );
+	}
+
+	for( unsigned i = 0; i < n; ++i )
+	{
+		auto addr = ( phys_addr_t )pages[i];
+
+		if( zeroed && i >= pooled )
+		{
+			_zero_pages( addr, 1 );
+		}
+		_flag_page_range( addr, flags & ~_request_flags, PAGE_SIZE );
+		_stat_alloc( addr / PAGE_SIZE, 1 );
+		pages[i] = ( void* )( addr + _memory_map_base );
+	}
+	return n;
+}
+
+void
+free_pages_bulk( void *const pages[], unsigned count )
+{
+	struct release_batch batch;
+
+	for( unsigned i = 0; i < count; ++i )
+	{
+		phys_addr_t addr = ( phys_addr_t )pages[i];
+		uint64_t pfn;
+
+		if( addr >= _memory_map_base )
+		{
+			addr -= _memory_map_base;
+		}
+
+		pfn = addr / PAGE_SIZE;
+		if( addr < PAGE_SIZE || pfn >= _memory_map_size * 8ULL ||
+		    ( _section_map != nullptr && _section_map[pfn >> SECTION_SHIFT] == nullptr ) )
+		{
+			continue;
+		}
+		_stat_free( pfn, 1 );
+		_release_batch_add( &batch, pfn );
 	}
+	_release_batch_end( &batch );
+}
 
-	_memory_map_lock.lock();
-	_mark_free_range( addr, PAGE_SIZE );
-	_free_page_range( addr, PAGE_SIZE );
-	_memory_map_lock.unlock();
+void
+free_page( const void* page )
+{
+	free_page_range( page, 1 );
 }
 
 void
 free_page_range( const void* page, unsigned count )
 {
 	phys_addr_t addr = ( phys_addr_t )page;
+	uint64_t pfn;
 
 	if( addr >= _memory_map_base )
 	{
@@ -459,30 +2301,62 @@ free_page_range( const void* page, unsigned count )
 		count = 1;
 	}
 
-	do {
-		phys_addr_t end_addr = addr + count * PAGE_SIZE;
-		if( end_addr / PAGE_SIZE / 32 + end_addr / PAGE_SIZE % 32 < _memory_map_size * 8 )
-		{
-			/* prevent out-of-bounds access */
-			break;
-		}
-		--count;
-	} while( count );
+	/* prevent out-of-bounds access */
+	pfn = addr / PAGE_SIZE;
+	if( pfn >= _memory_map_size * 8 )
+	{
+		return;
+	}
+	if( pfn + count > _memory_map_size * 8 )
+	{
+		count = _memory_map_size * 8 - pfn;
+	}
+	if( _section_map != nullptr && _section_map[pfn >> SECTION_SHIFT] == nullptr )
+	{
+		/* there is no RAM in this section */
+		return;
+	}
+	if( count == 1 && _page_cache_holds( pfn ) )
+	{
+		log::printk( "physmm: ignoring free of cached page %p\n", ( void* )addr );
+		return;
+	}
+	_stat_free( pfn, count );
 
-	if( count )
+	/* DMA and remote pages go straight back to their zone */
+	auto pcp = _local_page_cache();
+	if( count == 1 && pcp != nullptr && _peek_used( pfn ) &&
+	    _page_cache_zone( _zone_of( pfn ), _local_node() ) )
 	{
-		_memory_map_lock.lock();
-		_mark_free_range( addr, count * PAGE_SIZE );
-		_free_page_range( addr, count * PAGE_SIZE );
-		_memory_map_lock.unlock();
+		_chunk_online_locked( pfn );
+
+		uint64_t state = _page_cache_enter();
+
+		_free_page_range( pfn * PAGE_SIZE, PAGE_SIZE );
+		_page_cache_push_hot( pcp, pfn * PAGE_SIZE );
+		if( pcp->count > PHYSMM_PCP_HIGH )
+		{
+			_page_cache_drain( pcp, PHYSMM_PCP_BATCH );
+		}
+		_page_cache_leave( state );
+		return;
 	}
+
+	_release_range_locked( pfn, count );
 }
 
 page_map_t*
 get_page_map( phys_addr_t paddr )
 {
-	return ( ( paddr >> PAGE_SHIFT ) < _memory_map_size ) ? &memory_map_pages[ paddr >> 12 ]
-	                                                      : nullptr;
+	uint64_t pfn = paddr >> PAGE_SHIFT;
+
+	if( pfn >= _memory_map_size * 8ULL || _section_map == nullptr ||
+	    _section_map[pfn >> SECTION_SHIFT] == nullptr )
+	{
+		return nullptr;
+	}
+	_chunk_online_locked( pfn );
+	return _page_map( pfn );
 }
 
 };
@@ -42,6 +42,9 @@
 #define MMU_PHYS_ADDR_4K( pt  , vaddr ) (   pt[MMU_PT_INDEX ( vaddr )] & numeric( ~__VPF( Mask ) ) )
 #define MMU_PHYS_ADDR_2M( pdt , vaddr ) (  pdt[MMU_PDT_INDEX( vaddr )] & numeric( ~__VPF( Mask2M ) ) )
 
+/* pages requested from physmm at once by map_address_range */
+#define MAP_BULK_PAGES 64
+
 #define PHYS_ADDR( addr ) ( ( ( addr ) == 0 ) ? 0 : ( ( addr ) - physmm::physical_base_offset() ) )
 #define VIRT_ADDR( addr ) ( ( ( addr ) == 0 ) ? 0 : ( ( addr ) + physmm::physical_base_offset() ) )
 
@@ -91,11 +94,10 @@ _map_region( uint64_t *pml4, virt_addr_t vaddr, phys_addr_t paddr, size_t len,
 		pdpt = ( uint64_t* )VIRT_ADDR( MMU_PDPT_ADDR( pml4, vaddr ) );
 		if( pdpt == nullptr )
 		{
-			if( ( pdpt = ( uint64_t* )physmm::alloc_page( __PPF( Locked ) ) ) == nullptr )
+			if( ( pdpt = ( uint64_t* )physmm::alloc_page( __PPF( Locked ) | __PPF( Zeroed ) ) ) == nullptr )
 			{
 				return false;
 			}
-			memset( pdpt, 0, PAGE_SIZE );
 			pml4[MMU_PML4_INDEX( vaddr )] = PHYS_ADDR( ( uintptr_t )pdpt ) | 
 			                                numeric( __VPF( Present ) | __VPF( Writable ) );
 		}
@@ -103,11 +105,10 @@ _map_region( uint64_t *pml4, virt_addr_t vaddr, phys_addr_t paddr, size_t len,
 		pdt = ( uint64_t* )VIRT_ADDR( MMU_PDT_ADDR( pdpt, vaddr ) );
 		if( pdt == nullptr )
 		{
-			if( ( pdt = ( uint64_t* )physmm::alloc_page( __PPF( Locked ) ) ) == nullptr )
+			if( ( pdt = ( uint64_t* )physmm::alloc_page( __PPF( Locked ) | __PPF( Zeroed ) ) ) == nullptr )
 			{
 				return false;
 			}
-			memset( pdt, 0, PAGE_SIZE );
 			pdpt[MMU_PDPT_INDEX( vaddr )] = PHYS_ADDR( ( uintptr_t )pdt ) | 
 			                                numeric( __VPF( Present ) | __VPF( Writable ) );
 		}
@@ -115,11 +116,10 @@ _map_region( uint64_t *pml4, virt_addr_t vaddr, phys_addr_t paddr, size_t len,
 		pt = ( uint64_t* )VIRT_ADDR( MMU_PT_ADDR( pdt, vaddr ) );
 		if( pt == nullptr )
 		{
-			if( ( pt = ( uint64_t* )physmm::alloc_page( __PPF( Locked ) ) ) == nullptr )
+			if( ( pt = ( uint64_t* )physmm::alloc_page( __PPF( Locked ) | __PPF( Zeroed ) ) ) == nullptr )
 			{
 				return false;
 			}
-			memset( pt, 0, PAGE_SIZE );
 			pdt[MMU_PDT_INDEX( vaddr )] = PHYS_ADDR( ( uintptr_t )pt ) | 
 			                              numeric( __VPF( Present ) | __VPF( Writable ) );
 		}
@@ -134,7 +134,8 @@ _map_region( uint64_t *pml4, virt_addr_t vaddr, phys_addr_t paddr, size_t len,
 }
 
 static bool
-_unmap_region( uint64_t *pml4, virt_addr_t vaddr, size_t len, bool free_page )
+_unmap_region( uint64_t *pml4, virt_addr_t vaddr, size_t len, bool free_page,
+               bool flush = true )
 {
 	uint64_t *pdpt  = nullptr,
 	         *pdt   = nullptr,
@@ -183,7 +184,10 @@ _unmap_region( uint64_t *pml4, virt_addr_t vaddr, size_t len, bool free_page )
 			pt[MMU_PT_INDEX( vaddr )] = 0;
 		}
 		/* FIXME: other cores need to know that too */
-		__asm__ __volatile__( "invlpg %0" :: "m"( vaddr ) );
+		if( flush )
+		{
+			__asm__ __volatile__( "invlpg %0" :: "m"( vaddr ) );
+		}
 
 		vaddr += PAGE_SIZE;
 	} while( --len );
@@ -195,11 +199,10 @@ void _create_system_vm( void )
 {
 	log::printk( "Initializing kernel virtual address space..\n" );
 
-	if( ( _system_pml4 = ( uint64_t* )physmm::alloc_page( __PPF( Locked ) ) ) == nullptr )
+	if( ( _system_pml4 = ( uint64_t* )physmm::alloc_page( __PPF( Locked ) | __PPF( Zeroed ) ) ) == nullptr )
 	{
 		goto error_out;
 	}
-	memset( _system_pml4, 0, PAGE_SIZE );
 
 	/* map the video ram (bootstrap needs it) */
 	if( !_map_region( _system_pml4, 0xa0000, 0xa0000, 80 * 26 * 2, __VPF( Writable ) ) )
@@ -255,9 +258,9 @@ bool
 map_address( virt_addr_t vaddr, Flags flags )
 {
 	uint64_t *pml4 = ( uint64_t* )VIRT_ADDR( processor::regs::read_cr3() );
-	phys_addr_t addr = ( phys_addr_t )physmm::alloc_page( __PPF( Active ) );
+	phys_addr_t addr = PHYS_ADDR( ( phys_addr_t )physmm::alloc_page( __PPF( Active ) ) );
 
-	return _map_region( pml4, vaddr, addr, PAGE_SIZE, flags );
+	return ( addr != 0 ) && _map_region( pml4, vaddr, addr, PAGE_SIZE, flags );
 }
 
 bool
@@ -270,16 +273,34 @@ map_fixed( virt_addr_t vaddr, phys_addr_t paddr, Flags flags )
 bool
 map_address_range( virt_addr_t vaddr, size_t npages, Flags flags )
 {
-	for( size_t n = 0; n < npages; ++n )
+	uint64_t *pml4 = ( uint64_t* )VIRT_ADDR( processor::regs::read_cr3() );
+	void *pages[MAP_BULK_PAGES];
+	size_t n = 0;
+
+	while( n < npages )
 	{
-		if( map_address( vaddr, flags ) == false )
+		unsigned batch = ( npages - n < MAP_BULK_PAGES ) ? npages - n : MAP_BULK_PAGES;
+		unsigned count = physmm::alloc_pages_bulk( batch, __PPF( Active ), pages );
+		unsigned i     = 0;
+
+		for( ; i < count; ++i, ++n )
+		{
+			if( !_map_region( pml4, vaddr + PAGE_SIZE * n,
+			                  PHYS_ADDR( ( phys_addr_t )pages[i] ), PAGE_SIZE, flags ) )
+			{
+				break;
+			}
+		}
+		if( i < batch )
 		{
 			/* backtrack */
-			vaddr -= PAGE_SIZE * n;
-			unmap_address_range( vaddr, n - 1 );
+			physmm::free_pages_bulk( &pages[i], count - i );
+			if( n > 0 )
+			{
+				unmap_address_range( vaddr, n );
+			}
 			return false;
 		}
-		vaddr += PAGE_SIZE;
 	}
 	return true;
 }
@@ -299,10 +320,17 @@ unmap_fixed( virt_addr_t vaddr )
 }
 
 void
-unmap_address_range( virt_addr_t vaddr, size_t npages )
+unmap_address_range( virt_addr_t vaddr, size_t npages, bool flush )
 {
 	uint64_t *pml4 = ( uint64_t* )VIRT_ADDR( processor::regs::read_cr3() );
-	( void )_unmap_region( pml4, vaddr, PAGE_SIZE * npages, true );
+	( void )_unmap_region( pml4, vaddr, PAGE_SIZE * npages, true, flush );
+}
+
+void
+flush_tlb( void )
+{
+	/* FIXME: other cores need to know that too */
+	processor::regs::write_cr3( processor::regs::read_cr3() );
 }
 
 bool
@@ -0,0 +1,337 @@
+/*******************************************************************************
+
+    Copyright (C) 2014  René 'Shirk' Köcher
+ 
+    This file is part of Hotarubi.
+
+    Hotarubi is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+ 
+    Hotarubi is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+ 
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*******************************************************************************/
+
+
+/* vmalloc / vfree
+ *
+ * Allocations take a range of kVMRangeHeap followed by an unmapped guard page
+ * and map pages from physmm one by one. Ranges are handed out from the end of
+ * the last one while the heap lasts, the gaps between areas are searched
+ * after that.
+ * vfree() unmaps and frees the pages right away but skips the TLB shootdown,
+ * the range stays reserved ( lazy ) until VMALLOC_LAZY_PAGES freed pages have
+ * piled up. A single flush then makes all lazy ranges available again.
+ * Areas are kept on a list by address for the gap search and in a treap by
+ * start address, which keeps vfree() and size() lookups at O( log n ).
+ */
+
+#include <list.h>
+#include <hotarubi/types.h>
+#include <hotarubi/lock.h>
+
+#include <hotarubi/memory/const.h>
+#include <hotarubi/memory/virtmm.h>
+#include <hotarubi/memory/vmalloc.h>
+#include <hotarubi/memory/object_cache.h>
+#include <hotarubi/log/log.h>
+
+/* freed pages waiting for a TLB flush before their range is reused */
+#define VMALLOC_LAZY_PAGES 8192
+
+#define VMALLOC_GUARD_PAGES 1
+
+namespace memory
+{
+namespace vmalloc
+{
+
+struct vm_area
+{
+	virt_addr_t start;
+	size_t pages; /* mapped pages, not counting the guard */
+	bool lazy;
+
+	LIST_LINK( areas );
+	struct vm_area *left, *right; /* treap by start */
+};
+
+static spin_lock _vmalloc_lock;
+static LIST_HEAD( _vmalloc_areas ) = LIST_INIT( _vmalloc_areas ); /* by address */
+static struct vm_area *_vmalloc_tree = nullptr;
+static object_cache<vm_area> _vmalloc_area_cache;
+
+static virt_addr_t _vmalloc_next = virtmm::kVMRangeHeapBase; /* end of the last area */
+static size_t _vmalloc_lazy     = 0;
+
+static inline virt_addr_t
+_area_end( struct vm_area *area )
+{
+	return area->start + ( area->pages + VMALLOC_GUARD_PAGES ) * PAGE_SIZE;
+}
+
+/* heap order of the treap, a hash of the start address keeps it balanced
+ * even though addresses are mostly handed out in ascending order */
+static inline uint64_t
+_tree_priority( struct vm_area *area )
+{
+	return area->start * 0x9e3779b97f4a7c15ull;
+}
+
+static inline void
+_tree_rotate_left( struct vm_area **link )
+{
+	auto node   = *link;
+	auto right  = node->right;
+	node->right = right->left;
+	right->left = node;
+	*link       = right;
+}
+
+static inline void
+_tree_rotate_right( struct vm_area **link )
+{
+	auto node   = *link;
+	auto left   = node->left;
+	node->left  = left->right;
+	left->right = node;
+	*link       = left;
+}
+
+static void
+_tree_insert( struct vm_area **link, struct vm_area *area )
+{
+	auto node = *link;
+
+	if( node == nullptr )
+	{
+		area->left  = nullptr;
+		area->right = nullptr;
+		*link       = area;
+	}
+	else if( area->start < node->start )
+	{
+		_tree_insert( &node->left, area );
+		if( _tree_priority( node->left ) > _tree_priority( node ) )
+		{
+			_tree_rotate_right( link );
+		}
+	}
+	else
+	{
+		_tree_insert( &node->right, area );
+		if( _tree_priority( node->right ) > _tree_priority( node ) )
+		{
+			_tree_rotate_left( link );
+		}
+	}
+}
+
+static void
+_tree_remove( struct vm_area *area )
+{
+	auto link = &_vmalloc_tree;
+
+	while( *link != area )
+	{
+		link = ( area->start < ( *link )->start ) ? &( *link )->left : &( *link )->right;
+	}
+
+	/* rotate area down until it has a single child left */
+	while( area->left != nullptr && area->right != nullptr )
+	{
+		if( _tree_priority( area->left ) > _tree_priority( area->right ) )
+		{
+			_tree_rotate_right( link );
+			link = &( *link )->right;
+		}
+		else
+		{
+			_tree_rotate_left( link );
+			link = &( *link )->left;
+		}
+	}
+	*link = ( area->left != nullptr ) ? area->left : area->right;
+}
+
+/* find space for size bytes and link area there - expects _vmalloc_lock */
+static bool
+_area_insert( struct vm_area *area, size_t size )
+{
+	if( _vmalloc_next + size - 1 <= virtmm::kVMRangeHeapEnd )
+	{
+		area->start   = _vmalloc_next;
+		_vmalloc_next = area->start + size;
+		list_add_tail( &_vmalloc_areas, &area->areas );
+		_tree_insert( &_vmalloc_tree, area );
+		return true;
+	}
+
+	/* first fit in the gaps */
+	virt_addr_t start = virtmm::kVMRangeHeapBase;
+	LIST_FOREACH( item, &_vmalloc_areas )
+	{
+		auto next = LIST_ENTRY( item, struct vm_area, areas );
+
+		if( next->start - start >= size )
+		{
+			area->start = start;
+			list_add_tail( item, &area->areas ); /* in front of next */
+			_tree_insert( &_vmalloc_tree, area );
+			return true;
+		}
+		start = _area_end( next );
+	}
+	return false;
+}
+
+/* make the lazy ranges available again - expects _vmalloc_lock */
+static void
+_vmalloc_purge( void )
+{
+	if( _vmalloc_lazy == 0 )
+	{
+		return;
+	}
+
+	virtmm::flush_tlb();
+	LIST_FOREACH_MUTABLE( item, &_vmalloc_areas )
+	{
+		auto area = LIST_ENTRY( item, struct vm_area, areas );
+		if( area->lazy )
+		{
+			list_del( &area->areas );
+			_tree_remove( area );
+			_vmalloc_area_cache.destroy( area );
+		}
+	}
+	_vmalloc_lazy = 0;
+	_vmalloc_next = ( list_empty( &_vmalloc_areas ) )
+	                ? virtmm::kVMRangeHeapBase
+	                : _area_end( LIST_ENTRY( _vmalloc_areas.prev, struct vm_area, areas ) );
+}
+
+/* the live area starting at ptr - expects _vmalloc_lock */
+static struct vm_area*
+_area_lookup( const void *ptr )
+{
+	auto area = _vmalloc_tree;
+
+	while( area != nullptr && area->start != ( virt_addr_t )ptr )
+	{
+		area = ( ( virt_addr_t )ptr < area->start ) ? area->left : area->right;
+	}
+	return ( area != nullptr && !area->lazy ) ? area : nullptr;
+}
+
+bool
+owns( const void *ptr )
+{
+	return ( virt_addr_t )ptr >= virtmm::kVMRangeHeapBase &&
+	       ( virt_addr_t )ptr <= virtmm::kVMRangeHeapEnd;
+}
+
+size_t
+size( const void *ptr )
+{
+	scoped_lock lock( _vmalloc_lock );
+
+	auto area = _area_lookup( ptr );
+	return ( area != nullptr ) ? area->pages * PAGE_SIZE : 0;
+}
+
+void
+init( void )
+{
+	_vmalloc_area_cache.init( "vmalloc::area" );
+}
+
+};
+};
+
+using namespace memory::vmalloc;
+
+void*
+vmalloc( size_t n )
+{
+	size_t pages = ( n + PAGE_SIZE - 1 ) / PAGE_SIZE;
+	size_t size  = ( pages + VMALLOC_GUARD_PAGES ) * PAGE_SIZE;
+
+	if( pages == 0 )
+	{
+		return nullptr;
+	}
+
+	auto area = _vmalloc_area_cache.create();
+	if( area == nullptr )
+	{
+		return nullptr;
+	}
+	area->pages = pages;
+	area->lazy  = false;
+
+	_vmalloc_lock.lock();
+	bool reserved = _area_insert( area, size );
+	if( !reserved )
+	{
+		_vmalloc_purge();
+		reserved = _area_insert( area, size );
+	}
+	_vmalloc_lock.unlock();
+
+	if( !reserved )
+	{
+		log::printk( "vmalloc: out of address space for %zd bytes!\n", n );
+		_vmalloc_area_cache.destroy( area );
+		return nullptr;
+	}
+
+	/* the range is ours, map it without holding the lock */
+	if( !memory::virtmm::map_address_range( area->start, pages,
+	                                        __VPF( Writable ) | __VPF( NoExecute ) ) )
+	{
+		log::printk( "vmalloc: can't serve request for %zd bytes!\n", n );
+
+		scoped_lock lock( _vmalloc_lock );
+		list_del( &area->areas );
+		_tree_remove( area );
+
+		/* hand the range back unless a later area was placed behind it */
+		if( _area_end( area ) == _vmalloc_next )
+		{
+			_vmalloc_next = area->start;
+		}
+		_vmalloc_area_cache.destroy( area );
+		return nullptr;
+	}
+	return ( void* )area->start;
+}
+
+void
+vfree( void *ptr )
+{
+	scoped_lock lock( _vmalloc_lock );
+
+	auto area = _area_lookup( ptr );
+	if( area == nullptr )
+	{
+		panic( "vfree: attempting to free %p which is not managed by vmalloc!", ptr );
+		return;
+	}
+
+	memory::virtmm::unmap_address_range( area->start, area->pages, false );
+	area->lazy     = true;
+	_vmalloc_lazy += area->pages;
+
+	if( _vmalloc_lazy >= VMALLOC_LAZY_PAGES )
+	{
+		_vmalloc_purge();
+	}
+}
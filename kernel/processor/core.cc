@@ -21,7 +21,6 @@
 
 /* methods dealing directly with the CPU or per-CPU local data */
 
-#include <new>
 #include <string.h>
 
 #include <hotarubi/processor/core.h>
@@ -33,6 +32,10 @@
 #include <hotarubi/processor/local_data.h>
 
 #include <hotarubi/acpi/acpi.h>
+#include <hotarubi/memory/arena.h>
+#include <hotarubi/memory/cache.h>
+#include <hotarubi/memory/physmm.h>
+#include <hotarubi/memory/kmalloc_profile.h>
 
 #include <hotarubi/lock.h>
 #include <hotarubi/log/log.h>
@@ -47,6 +50,7 @@ namespace processor
 #define IA32_KERNEL_GSBASE 0xc0000102
 
 LOCAL_DATA_DEF( uint8_t id );
+LOCAL_DATA_DEF( uint8_t node ); /* NUMA node, set by acpi::parse_madt */
 
 static spin_lock _processor_accounting_lock;
 static unsigned  _processor_active_count = 0;
@@ -96,7 +100,7 @@ core::irqs( void )
 {
 	if( _interrupts == nullptr )
 	{
-		_interrupts = new( std::nothrow ) struct interrupt[NUM_IRQ_ENTRIES];
+		_interrupts = new( memory::boot_arena() ) struct interrupt[NUM_IRQ_ENTRIES];
 		for( unsigned i = 0; i < NUM_IRQ_ENTRIES; ++i )
 		{
 			_interrupts[i].setup( i, i );
@@ -194,6 +198,10 @@ init( void )
 	regs::write_msr( IA32_GS_BASE      , ( uintptr_t )local );
 	regs::write_msr( IA32_KERNEL_GSBASE, ( uintptr_t )local );
 
+	memory::physmm::init_page_cache();
+	memory::cache::init_cpu_cache();
+	memory::kmalloc_profile::init_cpu();
+
 	tss::init();
 	gdt::init();
 	idt::init();
@@ -209,7 +217,7 @@ init( void )
 		}
 
 		core::current()->lapic->init();
-		_pit = new( std::nothrow ) pit;
+		_pit = new( memory::boot_arena() ) pit;
 		_pit->init();
 	}
 
@@ -29,6 +29,7 @@
 #include <hotarubi/processor/core.h>
 #include <hotarubi/memory/physmm.h>
 #include <hotarubi/memory/const.h>
+#include <hotarubi/log/log.h>
 
 LOCAL_DATA_INC( hotarubi/tss.h );
 LOCAL_DATA_DEF( struct tss::tss *tss );
@@ -52,14 +53,20 @@ init( void )
 		tss = new( std::nothrow ) struct tss;
 	}
 
+	/* rsp0 and ist[0] - ist[3] */
+	void *stacks[5];
+	if( memory::physmm::alloc_pages_bulk( 5, __PPF( Locked ), stacks ) != 5 )
+	{
+		panic( "out of memory while allocating the TSS stacks!" );
+	}
+
 	memset( tss, 0, sizeof( struct tss ) );
-	tss->rsp0   = PAGE_SIZE + ( uint64_t )memory::physmm::alloc_page( __PPF( Locked ) );
-	tss->ist[0] = PAGE_SIZE + ( uint64_t )memory::physmm::alloc_page( __PPF( Locked ) );
-	tss->ist[1] = PAGE_SIZE + ( uint64_t )memory::physmm::alloc_page( __PPF( Locked ) );
-	tss->ist[2] = PAGE_SIZE + ( uint64_t )memory::physmm::alloc_page( __PPF( Locked ) );
-	tss->ist[3] = PAGE_SIZE + ( uint64_t )memory::physmm::alloc_page( __PPF( Locked ) );
+	tss->rsp0   = PAGE_SIZE + ( uint64_t )stacks[0];
+	tss->ist[0] = PAGE_SIZE + ( uint64_t )stacks[1];
+	tss->ist[1] = PAGE_SIZE + ( uint64_t )stacks[2];
+	tss->ist[2] = PAGE_SIZE + ( uint64_t )stacks[3];
+	tss->ist[3] = PAGE_SIZE + ( uint64_t )stacks[4];
 
-	/* FIXME: verify those allocations! */
 	processor::core::current()->tss = tss;
 }
 